@@ -8,14 +8,21 @@
 
 #import "TableBase.h"
 
-@interface Attachment : TableBase
+@interface Attachment : TableBase {
+    NSData * _pendingData;
+}
 
 @property ID_type ID;
 @property ID_type messageID;
 @property NSString * filename;
-@property NSString * encodedData;
+@property int size;
 
 // Accessors
 +(NSArray *)attachmentsForMessage:(ID_type)messageID;
++(void)createDataStore;
++(void)migrateEncodedData;
 -(NSData *)data;
+-(void)setData:(NSData *)data;
+-(BOOL)setDataFromStream:(NSInputStream *)stream length:(NSUInteger)length;
+-(BOOL)writeDataToStream:(NSOutputStream *)stream;
 @end
@@ -6,11 +6,99 @@
 //  Copyright © 2016 CIXOnline Ltd. All rights reserved.
 //
 
+#import "CIX.h"
+#import "FMDatabase.h"
+#import "FMDatabaseAdditions.h"
+#import "StringExtensions.h"
 #import "Attachment.h"
 
+// Attachment contents are read and written in pieces of this size so that
+// a large file is never copied in full by SQLite.
+static const int AttachmentChunkSize = 64 * 1024;
+
+// Number of legacy attachments converted in each migration transaction
+static const int MigrationBatchSize = 20;
+
+// Set if the Attachment table still has the base64 column from older databases
+static BOOL _hasEncodedData = NO;
+
 @implementation Attachment
 
-/* Return an array of all the attachments for the specified message
+/* Index attachments by the message that owns them.
+ */
++(NSDictionary *)indexes
+{
+    return @{ @"messageID" : @"(messageID)" };
+}
+
+/** Create the table that holds attachment contents
+ 
+ The contents of each attachment are stored as a BLOB in the AttachmentData
+ table keyed by the attachment ID, away from the metadata in the Attachment
+ table, so that listing the attachments of a message never reads them. A
+ trigger removes the contents when the attachment is deleted.
+ */
++(void)createDataStore
+{
+    @synchronized(CIX.DBLock) {
+        [CIX.DB executeUpdate:@"create table if not exists AttachmentData (attachmentID INTEGER PRIMARY KEY, data BLOB)"];
+        [CIX.DB executeUpdate:@"create trigger if not exists Attachment_ad after delete on Attachment begin "
+                               "delete from AttachmentData where attachmentID = old.ID; end"];
+        _hasEncodedData = [CIX.DB columnExists:@"encodedData" inTableWithName:@"Attachment"];
+    }
+}
+
+/** Move base64 attachment contents from older databases into the data store
+ 
+ The conversion runs in the background in small batches, each in its own
+ transaction, so that startup is not held up and the database lock is
+ released between batches. Attachments are readable throughout since
+ data falls back on the base64 column until an attachment is converted.
+ */
++(void)migrateEncodedData
+{
+    if (!_hasEncodedData)
+        return;
+    
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        int countOfMigrated = 0;
+        BOOL isDone = NO;
+        
+        while (!isDone)
+        {
+            @synchronized(CIX.DBLock) {
+                NSMutableArray * batchIDs = [NSMutableArray array];
+                NSMutableArray * batchData = [NSMutableArray array];
+                
+                FMResultSet * results = [CIX.DB executeQuery:@"select ID, encodedData from Attachment where encodedData is not null limit ?", @(MigrationBatchSize)];
+                while ([results next])
+                {
+                    NSData * data = [[NSData alloc] initWithBase64EncodedString:SafeString([results stringForColumnIndex:1]) options:0];
+                    [batchIDs addObject:@([results longLongIntForColumnIndex:0])];
+                    [batchData addObject:data != nil ? data : [NSData data]];
+                }
+                [results close];
+                
+                [CIX.DB beginTransaction];
+                for (NSUInteger index = 0; index < batchIDs.count; ++index)
+                {
+                    NSData * data = batchData[index];
+                    [CIX.DB executeUpdate:@"insert or replace into AttachmentData (attachmentID, data) values (?, ?)", batchIDs[index], data];
+                    [CIX.DB executeUpdate:@"update Attachment set size=?, encodedData=null where ID=?", @(data.length), batchIDs[index]];
+                }
+                [CIX.DB commit];
+                
+                countOfMigrated += batchIDs.count;
+                isDone = batchIDs.count < MigrationBatchSize;
+            }
+        }
+        if (countOfMigrated > 0)
+            [LogFile.logFile writeLine:@"Moved %d attachments to the attachment data store", countOfMigrated];
+    });
+}
+
+/* Return an array of all the attachments for the specified message. Only
+ * the metadata is loaded and not the contents.
  */
 +(NSArray *)attachmentsForMessage:(ID_type)messageID
 {
@@ -18,11 +106,195 @@
     return [Attachment allRowsWithQuery:query];
 }
 
+/** Save the attachment
+ 
+ Contents set on an attachment that had not yet been saved are written to
+ the data store once the attachment has an ID.
+ */
+-(void)save
+{
+    @synchronized(CIX.DBLock) {
+        [super save];
+        if (_pendingData != nil)
+        {
+            NSData * data = _pendingData;
+            _pendingData = nil;
+            [self setData:data];
+        }
+    }
+}
+
+/** Set the contents of the attachment
+ 
+ If the contents cannot be written to the data store, they are kept with
+ the attachment and written by the next save.
+ 
+ @param data The raw contents of the attached file
+ */
+-(void)setData:(NSData *)data
+{
+    if (self.ID == 0)
+    {
+        _pendingData = data;
+        self.size = (int)data.length;
+        return;
+    }
+    BOOL success = [self setDataFromStream:[NSInputStream inputStreamWithData:data] length:data.length];
+    _pendingData = success ? nil : data;
+}
+
+/** Set the contents of the attachment from a stream
+ 
+ Space for the contents is reserved up front and the stream is then copied
+ in a chunk at a time using SQLite's incremental BLOB I/O. The attachment
+ must already have been saved. If the stream cannot be copied in full, the
+ data store is left as it was before the call.
+ 
+ @param stream The stream from which to read the contents
+ @param length The number of bytes to read from the stream
+ @return YES if the contents were written, NO otherwise.
+ */
+-(BOOL)setDataFromStream:(NSInputStream *)stream length:(NSUInteger)length
+{
+    BOOL success = NO;
+    uint8_t * buffer = malloc(AttachmentChunkSize);
+    
+    @synchronized(CIX.DBLock) {
+        FMDatabase * db = CIX.DB;
+        
+        // A savepoint rather than a transaction so that this works whether or
+        // not the caller already has a transaction open.
+        [db startSavePointWithName:@"AttachmentData" error:nil];
+        
+        sqlite3_blob * blob = NULL;
+        if ([db executeUpdate:@"insert or replace into AttachmentData (attachmentID, data) values (?, zeroblob(?))", @(self.ID), @(length)] &&
+            sqlite3_blob_open(db.sqliteHandle, "main", "AttachmentData", "data", self.ID, 1, &blob) == SQLITE_OK)
+        {
+            NSUInteger offset = 0;
+            
+            [stream open];
+            while (offset < length)
+            {
+                NSInteger count = [stream read:buffer maxLength:MIN(AttachmentChunkSize, length - offset)];
+                if (count <= 0 || sqlite3_blob_write(blob, buffer, (int)count, (int)offset) != SQLITE_OK)
+                    break;
+                offset += count;
+            }
+            [stream close];
+            sqlite3_blob_close(blob);
+            success = offset == length;
+        }
+        
+        if (success)
+        {
+            if (self.size != (int)length)
+            {
+                self.size = (int)length;
+                [super save];
+            }
+        }
+        else
+        {
+            [db rollbackToSavePointWithName:@"AttachmentData" error:nil];
+            [LogFile.logFile writeLine:@"Failed to store the contents of attachment %@ (%lld)", self.filename, self.ID];
+        }
+        [db releaseSavePointWithName:@"AttachmentData" error:nil];
+    }
+    free(buffer);
+    return success;
+}
+
+/** Write the contents of the attachment to a stream
+ 
+ The contents are copied a chunk at a time using SQLite's incremental BLOB
+ I/O so that they are never held in memory in full. The stream must already
+ be open.
+ 
+ @param stream The stream to which the contents are written
+ @return YES if all of the contents were written, NO otherwise.
+ */
+-(BOOL)writeDataToStream:(NSOutputStream *)stream
+{
+    if (_pendingData != nil)
+        return [stream write:_pendingData.bytes maxLength:_pendingData.length] == (NSInteger)_pendingData.length;
+    
+    BOOL isStored = NO;
+    BOOL success = [self writeStoredDataToStream:stream isStored:&isStored];
+    
+    // Not yet moved to the data store so use the base64 column instead. If
+    // that has gone too, the migration moved it after we looked, so look in
+    // the data store again.
+    if (!isStored && _hasEncodedData)
+    {
+        NSData * data = [self legacyData];
+        if (data != nil)
+            success = [stream write:data.bytes maxLength:data.length] == (NSInteger)data.length;
+        else
+            success = [self writeStoredDataToStream:stream isStored:&isStored];
+    }
+    return success;
+}
+
+/* Copy the contents of the attachment from the data store to a stream,
+ * setting isStored to whether the data store has them.
+ */
+-(BOOL)writeStoredDataToStream:(NSOutputStream *)stream isStored:(BOOL *)isStored
+{
+    __block BOOL success = NO;
+    __block BOOL isFound = NO;
+    
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        sqlite3_blob * blob = NULL;
+        if (sqlite3_blob_open(db.sqliteHandle, "main", "AttachmentData", "data", self.ID, 0, &blob) != SQLITE_OK)
+            return;
+        
+        uint8_t * buffer = malloc(AttachmentChunkSize);
+        int length = sqlite3_blob_bytes(blob);
+        int offset = 0;
+        
+        while (offset < length)
+        {
+            int count = MIN(AttachmentChunkSize, length - offset);
+            if (sqlite3_blob_read(blob, buffer, count, offset) != SQLITE_OK || [stream write:buffer maxLength:count] != count)
+                break;
+            offset += count;
+        }
+        free(buffer);
+        sqlite3_blob_close(blob);
+        
+        isFound = YES;
+        success = offset == length;
+    }];
+    
+    *isStored = isFound;
+    return success;
+}
+
 /** Return the raw data for the attachment.
  */
 -(NSData *)data
 {
-    return [[NSData alloc] initWithBase64EncodedString:self.encodedData options:0];
+    if (_pendingData != nil)
+        return _pendingData;
+    
+    NSOutputStream * stream = [NSOutputStream outputStreamToMemory];
+    [stream open];
+    BOOL success = [self writeDataToStream:stream];
+    NSData * data = [stream propertyForKey:NSStreamDataWrittenToMemoryStreamKey];
+    [stream close];
+    return success ? data : nil;
+}
+
+/* Return the contents of an attachment that is still stored in the
+ * base64 column of an older database.
+ */
+-(NSData *)legacyData
+{
+    __block NSString * encodedData = nil;
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        encodedData = [db stringForQuery:@"select encodedData from Attachment where ID=?", @(self.ID)];
+    }];
+    return (encodedData != nil) ? [[NSData alloc] initWithBase64EncodedString:encodedData options:0] : nil;
 }
 
 /* Call superclass to get description format
@@ -23,7 +23,7 @@
 #define AccountTypeFull         0
 #define AccountTypeBasic        1
 
-#define LatestDatabaseVersion   6
+#define LatestDatabaseVersion   9
 
 @class FMDatabase;
 
@@ -50,6 +50,7 @@
 // Accessors
 +(FMDatabase *)DB;
 +(id)DBLock;
++(void)inReadDatabase:(void (^)(FMDatabase * db))block;
 +(void)compactDatabase;
 +(FolderCollection *)folderCollection;
 +(ProfileCollection *)profileCollection;
@@ -69,6 +70,8 @@
 +(void)setTaskInterval:(int)newInterval;
 +(NSDate *)lastSyncDate;
 +(void)setLastSyncDate:(NSDate *)date;
++(NSDate *)syncCursor;
++(void)setSyncCursor:(NSDate *)date;
 +(void)setOnline:(BOOL)newOnline;
 +(void)reportServerExceptions:(const char *)methodName exception:(NSException *)exception;
 +(void)reportServerErrors:(const char *)methodName error:(NSError *)error;
@@ -8,15 +8,82 @@
 
 #import "CIX.h"
 #import "FMDatabase.h"
+#import "FMDatabasePool.h"
 #import "StringExtensions.h"
 #import "FileManagerExtensions.h"
 #import "Who.h"
 #import "Account.h"
 #import "Global.h"
 
+// Maximum number of read-only connections in the read pool
+static const NSUInteger MaxReadConnections = 4;
+
+/* The writer connection. It records the thread that owns any open
+ * transaction so that reads on that thread see its uncommitted changes.
+ */
+@interface CIXDatabase : FMDatabase {
+    NSThread * _transactionThread;
+}
+
+-(BOOL)inTransactionOnCurrentThread;
+@end
+
+/* One stage of a sync. A stage starts once every stage named in its
+ * dependencies has finished, so stages that share no data run together.
+ */
+@interface SyncStage : NSObject
+
+@property (nonatomic) NSString * name;
+@property (nonatomic) NSArray * dependencies;
+@property (nonatomic) qos_class_t priority;
+@property (nonatomic, copy) void (^work)(void);
+@property (nonatomic) NSTimeInterval duration;
+
++(SyncStage *)stageNamed:(NSString *)name priority:(qos_class_t)priority dependencies:(NSArray *)dependencies work:(void (^)(void))work;
+@end
+
+@implementation CIXDatabase
+
+-(BOOL)beginTransaction
+{
+    BOOL success = [super beginTransaction];
+    if (success)
+        _transactionThread = [NSThread currentThread];
+    return success;
+}
+
+-(BOOL)beginDeferredTransaction
+{
+    BOOL success = [super beginDeferredTransaction];
+    if (success)
+        _transactionThread = [NSThread currentThread];
+    return success;
+}
+
+-(BOOL)commit
+{
+    _transactionThread = nil;
+    return [super commit];
+}
+
+-(BOOL)rollback
+{
+    _transactionThread = nil;
+    return [super rollback];
+}
+
+/* Return whether the calling thread has a transaction open.
+ */
+-(BOOL)inTransactionOnCurrentThread
+{
+    return self.inTransaction && _transactionThread == [NSThread currentThread];
+}
+@end
+
 // The CIX object is a class object. We should maybe think about changing
 // it to a singleton.
-static FMDatabase * _db = nil;
+static CIXDatabase * _db = nil;
+static FMDatabasePool * _readPool = nil;
 static NSString * _homeFolder = nil;
 static NSDateFormatter * _sqlDateFormat = nil;
 static NSDateFormatter * _cixDateFormat = nil;
@@ -36,6 +103,21 @@ static int _userAccountType;
 
 static const int FirstRunInterval = 2.0;
 
+@implementation SyncStage
+
+/* Create a sync stage.
+ */
++(SyncStage *)stageNamed:(NSString *)name priority:(qos_class_t)priority dependencies:(NSArray *)dependencies work:(void (^)(void))work
+{
+    SyncStage * stage = [SyncStage new];
+    stage.name = name;
+    stage.priority = priority;
+    stage.dependencies = dependencies;
+    stage.work = work;
+    return stage;
+}
+@end
+
 @implementation CIX
 
 /** Return the database instance.
@@ -129,6 +211,24 @@ static const int FirstRunInterval = 2.0;
     [_global setDatabaseLastSyncDate:date];
 }
 
+/** Return the point reached by an interrupted sync
+ 
+ @return The date from which an interrupted sync resumes, or nil if the last sync completed.
+ */
++(NSDate *)syncCursor
+{
+    return _global.databaseSyncCursor;
+}
+
+/** Set the point reached by a sync that is in progress
+ 
+ @param date The date from which the sync would resume if interrupted
+ */
++(void)setSyncCursor:(NSDate *)date
+{
+    [_global setDatabaseSyncCursor:date];
+}
+
 /** Return whether the CIX service is online.
  
  @return Returns YES if the service is online, or NO if it is offline.
@@ -219,6 +319,11 @@ static const int FirstRunInterval = 2.0;
 /* Perform a full synchronisation when the network state
  * changes or by the synchronisation duration specified by
  * the RunInterval variable.
+ *
+ * The collections are synced as stages which run concurrently where
+ * they share no data. Forum messages are what the user is waiting for
+ * so that stage runs at the highest priority. The directory stage waits
+ * for it since joining a forum adds to the folder collection.
  */
 +(void)sync
 {
@@ -229,15 +334,18 @@ static const int FirstRunInterval = 2.0;
             [nc postNotificationName:MACIXSynchronisationStarted object:nil];
         });
         
-        @try {
-            [self.directoryCollection sync];
-            [self.conversationCollection sync];
-            [self.profileCollection sync];
-            [self.folderCollection sync];
-        }
-        @catch (NSException *exception) {
-            [CIX reportServerExceptions:__PRETTY_FUNCTION__ exception:exception];
-        }
+        FolderCollection * folderCollection = self.folderCollection;
+        DirectoryCollection * directoryCollection = self.directoryCollection;
+        ConversationCollection * conversationCollection = self.conversationCollection;
+        ProfileCollection * profileCollection = self.profileCollection;
+        
+        NSArray * stages = @[
+            [SyncStage stageNamed:@"Forums" priority:QOS_CLASS_USER_INITIATED dependencies:@[] work:^{ [folderCollection sync]; }],
+            [SyncStage stageNamed:@"Conversations" priority:QOS_CLASS_UTILITY dependencies:@[] work:^{ [conversationCollection sync]; }],
+            [SyncStage stageNamed:@"Profile" priority:QOS_CLASS_UTILITY dependencies:@[] work:^{ [profileCollection sync]; }],
+            [SyncStage stageNamed:@"Directory" priority:QOS_CLASS_UTILITY dependencies:@[ @"Forums" ] work:^{ [directoryCollection sync]; }]
+        ];
+        [self runSyncStages:stages];
         
         dispatch_async(dispatch_get_main_queue(),^{
             NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
@@ -246,6 +354,66 @@ static const int FirstRunInterval = 2.0;
     }
 }
 
+/* Run the specified sync stages, starting each one as soon as the stages
+ * it depends on have finished, and return when they have all finished.
+ * The time taken by each stage is written to the log at the end.
+ */
++(void)runSyncStages:(NSArray *)stages
+{
+    NSMutableArray * waitingStages = [NSMutableArray arrayWithArray:stages];
+    NSMutableSet * finishedStages = [NSMutableSet set];
+    dispatch_semaphore_t stageFinished = dispatch_semaphore_create(0);
+    NSUInteger runningStages = 0;
+    NSDate * startDate = NSDate.date;
+    
+    while (waitingStages.count > 0 || runningStages > 0)
+    {
+        for (SyncStage * stage in [waitingStages copy])
+        {
+            BOOL isReady;
+            @synchronized(finishedStages) {
+                isReady = [[NSSet setWithArray:stage.dependencies] isSubsetOfSet:finishedStages];
+            }
+            if (!isReady)
+                continue;
+            
+            [waitingStages removeObject:stage];
+            ++runningStages;
+            dispatch_async(dispatch_get_global_queue(stage.priority, 0), ^{
+                NSDate * stageStartDate = NSDate.date;
+                @try {
+                    stage.work();
+                }
+                @catch (NSException *exception) {
+                    [CIX reportServerExceptions:__PRETTY_FUNCTION__ exception:exception];
+                }
+                stage.duration = [NSDate.date timeIntervalSinceDate:stageStartDate];
+                @synchronized(finishedStages) {
+                    [finishedStages addObject:stage.name];
+                }
+                dispatch_semaphore_signal(stageFinished);
+            });
+        }
+        
+        // A stage whose dependencies can never be met would otherwise
+        // leave us waiting forever.
+        if (runningStages == 0)
+        {
+            for (SyncStage * stage in waitingStages)
+                [LogFile.logFile writeLine:@"Sync stage %@ skipped: unmet dependencies %@", stage.name, [stage.dependencies componentsJoinedByString:@", "]];
+            break;
+        }
+        
+        dispatch_semaphore_wait(stageFinished, DISPATCH_TIME_FOREVER);
+        --runningStages;
+    }
+    
+    NSMutableArray * timings = [NSMutableArray array];
+    for (SyncStage * stage in stages)
+        [timings addObject:[NSString stringWithFormat:@"%@ %.2fs", stage.name, stage.duration]];
+    [LogFile.logFile writeLine:@"Sync stages completed in %.2fs (%@)", [NSDate.date timeIntervalSinceDate:startDate], [timings componentsJoinedByString:@", "]];
+}
+
 /** Return the global count of unread messages
 
  @return The count of unread messages across all services
@@ -360,6 +528,54 @@ static const int FirstRunInterval = 2.0;
     return [self class];
 }
 
+/** Run a block of database reads.
+ 
+ Reads are run on one of a pool of read-only connections so that they are
+ not blocked by a long write transaction on another thread. If the calling
+ thread has a write transaction open, the writer connection is used instead
+ so that the reads see the uncommitted changes.
+ 
+ Reads from the pool see the database as of the last commit, so only use
+ this for reads whose results are not cached or written back.
+ 
+ The block must not write to the database and must close any result sets
+ it opens before returning.
+ 
+ @param block The block to run, which is passed the connection to use
+ */
++(void)inReadDatabase:(void (^)(FMDatabase * db))block
+{
+    // Use the writer rather than ask the pool for a connection it does
+    // not have, which it would log as an error.
+    if (_readPool == nil || [_db inTransactionOnCurrentThread] || _readPool.countOfCheckedOutDatabases >= MaxReadConnections)
+    {
+        @synchronized(CIX.DBLock) {
+            block(_db);
+        }
+        return;
+    }
+    [_readPool inDatabase:^(FMDatabase * db) {
+        // The pool hands out nil once every read connection is busy
+        if (db != nil)
+            block(db);
+        else
+        {
+            @synchronized(CIX.DBLock) {
+                block(_db);
+            }
+        }
+    }];
+}
+
+/* Configure each new read connection before it joins the pool.
+ */
++(BOOL)databasePool:(FMDatabasePool *)pool shouldAddDatabaseToPool:(FMDatabase *)database
+{
+    [database setDateFormat:[self dateFormatter]];
+    [database setShouldCacheStatements:YES];
+    return YES;
+}
+
 /** Initialise the CIX service
  
  This method must be called before the CIX service methods can be used. It
@@ -375,7 +591,7 @@ static const int FirstRunInterval = 2.0;
  */
 +(BOOL)init:(NSString *)databasePath
 {
-    _db = [[FMDatabase alloc] initWithPath:databasePath];
+    _db = [[CIXDatabase alloc] initWithPath:databasePath];
     if (_db == nil || ![_db open])
         return NO;
 
@@ -383,11 +599,20 @@ static const int FirstRunInterval = 2.0;
     
     // Set flags on the db
     [_db setCrashOnErrors:YES];
+    [_db setShouldCacheStatements:YES];
+    
+    // Use write-ahead logging so readers in the pool are not blocked
+    // by a write transaction.
+    FMResultSet * journalMode = [_db executeQuery:@"pragma journal_mode=WAL"];
+    if (journalMode != nil && [journalMode next])
+        [LogFile.logFile writeLine:@"Database journal mode is %@", [journalMode stringForColumnIndex:0]];
+    [journalMode close];
     
     // Create remaining tables
     [Global create];
     [DirCategory create];
     [DirForum create];
+    [DirectoryCollection createTables];
     [Message create];
     [Folder create];
     [Conversation create];
@@ -410,10 +635,30 @@ static const int FirstRunInterval = 2.0;
         [Conversation upgrade];
     if (_global.databaseVersion < 5)
         [Profile upgrade];
-    if (_global.databaseVersion < 6)
+    if (_global.databaseVersion < 7)
         [Folder upgrade];
+    if (_global.databaseVersion < 8)
+        [Attachment upgrade];
+    if (_global.databaseVersion < 9)
+        [DirectoryCollection discardIndex];
     [_global setDatabaseVersion:LatestDatabaseVersion];
     
+    // Create any secondary indexes missing from older databases
+    [Message createIndexes];
+    [Attachment createIndexes];
+    [Profile createIndexes];
+    [Attachment createDataStore];
+    [MailMessage createIndexes];
+    [Message createSearchIndex];
+    
+    // Open the pool of read connections now the schema is complete
+    _readPool = [FMDatabasePool databasePoolWithPath:databasePath flags:SQLITE_OPEN_READONLY];
+    [_readPool setMaximumNumberOfDatabasesToCreate:MaxReadConnections];
+    [_readPool setDelegate:self];
+    
+    // Move attachments in older databases to the data store in the background
+    [Attachment migrateEncodedData];
+    
     return YES;
 }
 
@@ -468,6 +713,11 @@ static const int FirstRunInterval = 2.0;
         [_uiTimer invalidate];
         _uiTimer = nil;
     }
+    if (_readPool != nil)
+    {
+        [_readPool releaseAllDatabases];
+        _readPool = nil;
+    }
     if (_db != nil)
     {
         [_db close];
@@ -9,17 +9,27 @@
 #import "DirCategory.h"
 #import "DirForum.h"
 
+@class DirKeywordIndex;
+
 @interface DirectoryCollection : NSObject {
 @private
     NSMutableDictionary * _categories;
     NSMutableDictionary * _forums;
-    NSMutableDictionary * _indexList;
+    NSMutableDictionary * _forumsByName;
+    NSMutableDictionary * _forumsByCategory;
+    NSArray * _allForums;
+    DirKeywordIndex * _keywordIndex;
     NSUInteger _categoriesToRefesh;
-    NSArray * _stopWordList;
+    NSMutableArray * _pendingCategories;
+    NSMutableDictionary * _categoryListings;
+    NSDictionary * _categoryStates;
+    NSSet * _stopWords;
     BOOL _indexingEnabled;
 }
 
 // Accessors
++(void)createTables;
++(void)discardIndex;
 -(void)setIndexingEnabled:(BOOL)flag;
 -(NSArray *)categories;
 -(NSArray *)forums;
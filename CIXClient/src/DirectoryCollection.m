@@ -14,6 +14,344 @@
 #import "ForumDetailsGet.h"
 #import "DirListings.h"
 
+// Maximum number of category listings requested at once by a directory refresh
+static const NSUInteger MaxConcurrentCategoryRequests = 4;
+
+/* The forums listed in one category by a directory refresh, along with
+ * what identifies that version of the listing.
+ */
+@interface CategoryListing : NSObject
+@property (nonatomic) J_DirListings * listing;
+@property (nonatomic) NSString * etag;
+@property (nonatomic) NSString * contentHash;
+@end
+
+@implementation CategoryListing
+@end
+
+// Weight given to a term that only matches a query word as a prefix
+static const double PrefixMatchWeight = 0.5;
+
+// Shortest query word that is also matched as a prefix
+static const NSUInteger MinimumPrefixLength = 3;
+
+/* An inverted index of the words in forum descriptions. Each term maps to
+ * a posting list of the forums whose descriptions use it and how often, and
+ * the terms are also kept sorted so that prefixes can be looked up.
+ */
+@interface DirKeywordIndex : NSObject {
+    NSSet * _stopWords;
+    NSMutableDictionary * _postings;
+    NSMutableDictionary * _termsByForum;
+    NSArray * _sortedTerms;
+}
+
+-(id)initWithStopWords:(NSSet *)stopWords;
+-(NSUInteger)countOfTerms;
+-(NSDictionary *)termCountsFromText:(NSString *)text;
+-(void)setTermCounts:(NSDictionary *)termCounts forForum:(NSString *)forumName;
+-(NSArray *)forumsMatchingText:(NSString *)text;
+-(BOOL)load;
+-(void)saveAll;
+-(void)saveForum:(NSString *)forumName;
+@end
+
+@implementation DirKeywordIndex
+
+/* Initialise an empty index that ignores the given stop words.
+ */
+-(id)initWithStopWords:(NSSet *)stopWords
+{
+    if ((self = [super init]) != nil)
+    {
+        _stopWords = stopWords;
+        _postings = [NSMutableDictionary dictionary];
+        _termsByForum = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+/* Return the number of distinct terms in the index.
+ */
+-(NSUInteger)countOfTerms
+{
+    @synchronized(self) {
+        return _postings.count;
+    }
+}
+
+/* Return whether the character at the given index of a lower case word is a
+ * consonant. A 'y' is a consonant at the start of a word or after a vowel.
+ */
+static BOOL IsConsonantAt(NSString * word, NSUInteger index)
+{
+    switch ([word characterAtIndex:index])
+    {
+        case 'a': case 'e': case 'i': case 'o': case 'u':
+            return NO;
+        case 'y':
+            return index == 0 || !IsConsonantAt(word, index - 1);
+        default:
+            return YES;
+    }
+}
+
+/* Return whether a lower case word contains a vowel.
+ */
+static BOOL HasVowel(NSString * word)
+{
+    for (NSUInteger index = 0; index < word.length; ++index)
+        if (!IsConsonantAt(word, index))
+            return YES;
+    return NO;
+}
+
+/* Return the number of vowel-consonant sequences in a word, so that, for
+ * example, "gam" has one and "open" has two.
+ */
+static int CountOfSyllables(NSString * word)
+{
+    int count = 0;
+    BOOL afterVowel = NO;
+    for (NSUInteger index = 0; index < word.length; ++index)
+    {
+        BOOL isConsonant = IsConsonantAt(word, index);
+        if (isConsonant && afterVowel)
+            ++count;
+        afterVowel = !isConsonant;
+    }
+    return count;
+}
+
+/* Restore the form of a word whose -ing or -ed ending has been removed, by
+ * putting back a dropped "e" or removing a doubled consonant, so that
+ * "gaming" and "running" reduce to "game" and "run".
+ */
+static NSString * RepairStem(NSString * stem)
+{
+    NSUInteger length = stem.length;
+    if ([stem hasSuffix:@"at"] || [stem hasSuffix:@"bl"] || [stem hasSuffix:@"iz"])
+        return [stem stringByAppendingString:@"e"];
+    
+    unichar last = [stem characterAtIndex:length - 1];
+    if (length > 1 && last == [stem characterAtIndex:length - 2] && IsConsonantAt(stem, length - 1) && last != 'l' && last != 's' && last != 'z')
+        return [stem substringToIndex:length - 1];
+    
+    // A single syllable ending consonant-vowel-consonant, like "gam" or
+    // "hop", lost an "e".
+    if (length > 2 && CountOfSyllables(stem) == 1 &&
+        IsConsonantAt(stem, length - 1) && !IsConsonantAt(stem, length - 2) && IsConsonantAt(stem, length - 3) &&
+        last != 'w' && last != 'x' && last != 'y')
+        return [stem stringByAppendingString:@"e"];
+    return stem;
+}
+
+/* Reduce a word to a simple stem by removing common English plural and
+ * verb endings, so that, for example, "games", "gamed" and "gaming" all
+ * match "game". The word must already be in lower case.
+ */
+static NSString * StemWord(NSString * word)
+{
+    NSUInteger length = word.length;
+    if (length > 5 && [word hasSuffix:@"ing"] && HasVowel([word substringToIndex:length - 3]))
+        return RepairStem([word substringToIndex:length - 3]);
+    if (length > 4 && [word hasSuffix:@"ies"])
+        return [[word substringToIndex:length - 3] stringByAppendingString:@"y"];
+    if (length > 4 && [word hasSuffix:@"ed"] && ![word hasSuffix:@"eed"] && HasVowel([word substringToIndex:length - 2]))
+        return RepairStem([word substringToIndex:length - 2]);
+    if (length > 4 && ([word hasSuffix:@"ches"] || [word hasSuffix:@"shes"] || [word hasSuffix:@"xes"] || [word hasSuffix:@"sses"]))
+        return [word substringToIndex:length - 2];
+    if (length > 3 && [word hasSuffix:@"s"] && ![word hasSuffix:@"ss"])
+        return [word substringToIndex:length - 1];
+    return word;
+}
+
+/* Split text into normalised terms. Words are folded to lower case without
+ * diacritics, stop words and single characters are dropped and the rest
+ * are stemmed.
+ */
+-(NSArray *)termsFromText:(NSString *)text
+{
+    NSMutableArray * terms = [NSMutableArray array];
+    NSString * foldedText = [text stringByFoldingWithOptions:NSCaseInsensitiveSearch|NSDiacriticInsensitiveSearch locale:nil];
+    
+    for (NSString * word in [foldedText componentsSeparatedByCharactersInSet:NSCharacterSet.alphanumericCharacterSet.invertedSet])
+        if (word.length > 1 && ![_stopWords containsObject:word])
+            [terms addObject:StemWord(word)];
+    return terms;
+}
+
+/* Return the number of times each term occurs in the given text.
+ */
+-(NSDictionary *)termCountsFromText:(NSString *)text
+{
+    NSCountedSet * terms = [[NSCountedSet alloc] initWithArray:[self termsFromText:text]];
+    NSMutableDictionary * termCounts = [NSMutableDictionary dictionaryWithCapacity:terms.count];
+    for (NSString * term in terms)
+        termCounts[term] = @([terms countForObject:term]);
+    return termCounts;
+}
+
+/* Replace the postings for a forum with the given term counts.
+ */
+-(void)setTermCounts:(NSDictionary *)termCounts forForum:(NSString *)forumName
+{
+    @synchronized(self) {
+        for (NSString * term in _termsByForum[forumName])
+        {
+            NSMutableDictionary * posting = _postings[term];
+            [posting removeObjectForKey:forumName];
+            if (posting.count == 0)
+            {
+                [_postings removeObjectForKey:term];
+                _sortedTerms = nil;
+            }
+        }
+        
+        [termCounts enumerateKeysAndObjectsUsingBlock:^(NSString * term, NSNumber * count, BOOL * stop) {
+            NSMutableDictionary * posting = self->_postings[term];
+            if (posting == nil)
+            {
+                posting = [NSMutableDictionary dictionary];
+                self->_postings[term] = posting;
+                self->_sortedTerms = nil;
+            }
+            posting[forumName] = count;
+        }];
+        
+        if (termCounts.count > 0)
+            _termsByForum[forumName] = termCounts.allKeys;
+        else
+            [_termsByForum removeObjectForKey:forumName];
+    }
+}
+
+/* Return the terms that start with the given prefix, found by a binary
+ * search of the sorted terms.
+ */
+-(NSArray *)termsWithPrefix:(NSString *)prefix
+{
+    if (_sortedTerms == nil)
+        _sortedTerms = [_postings.allKeys sortedArrayUsingSelector:@selector(compare:)];
+    
+    NSUInteger index = [_sortedTerms indexOfObject:prefix
+                                     inSortedRange:NSMakeRange(0, _sortedTerms.count)
+                                           options:NSBinarySearchingInsertionIndex|NSBinarySearchingFirstEqual
+                                   usingComparator:^NSComparisonResult(NSString * term1, NSString * term2) {
+                                       return [term1 compare:term2];
+                                   }];
+    NSMutableArray * terms = [NSMutableArray array];
+    for (; index < _sortedTerms.count && [_sortedTerms[index] hasPrefix:prefix]; ++index)
+        [terms addObject:_sortedTerms[index]];
+    return terms;
+}
+
+/* Return the names of the forums matching the words in the given text,
+ * best match first. Each forum is scored by TF-IDF over the terms that
+ * match a query word exactly or, at a lower weight, by prefix.
+ */
+-(NSArray *)forumsMatchingText:(NSString *)text
+{
+    NSMutableDictionary * scores = [NSMutableDictionary dictionary];
+    
+    @synchronized(self) {
+        double countOfForums = _termsByForum.count;
+        
+        for (NSString * queryTerm in [NSSet setWithArray:[self termsFromText:text]])
+        {
+            NSArray * terms = (queryTerm.length >= MinimumPrefixLength) ? [self termsWithPrefix:queryTerm] : (_postings[queryTerm] ? @[ queryTerm ] : @[]);
+            for (NSString * term in terms)
+            {
+                NSDictionary * posting = _postings[term];
+                double weight = [term isEqualToString:queryTerm] ? 1.0 : PrefixMatchWeight;
+                double idf = log((countOfForums + 1) / posting.count);
+                
+                [posting enumerateKeysAndObjectsUsingBlock:^(NSString * forumName, NSNumber * count, BOOL * stop) {
+                    double score = [scores[forumName] doubleValue];
+                    scores[forumName] = @(score + weight * (1 + log(count.doubleValue)) * idf);
+                }];
+            }
+        }
+    }
+    
+    return [scores.allKeys sortedArrayUsingComparator:^NSComparisonResult(NSString * forum1, NSString * forum2) {
+        NSComparisonResult result = [scores[forum2] compare:scores[forum1]];
+        return (result != NSOrderedSame) ? result : [forum1 compare:forum2];
+    }];
+}
+
+/* Load the index saved in the database. Returns NO if there is no saved
+ * index.
+ */
+-(BOOL)load
+{
+    __block BOOL hasRows = NO;
+    NSMutableDictionary * forumTerms = [NSMutableDictionary dictionary];
+    
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        FMResultSet * results = [db executeQuery:@"select term, forum, frequency from DirKeyword"];
+        while ([results next])
+        {
+            NSString * term = [results stringForColumnIndex:0];
+            NSString * forumName = [results stringForColumnIndex:1];
+            
+            NSMutableDictionary * termCounts = forumTerms[forumName];
+            if (termCounts == nil)
+            {
+                termCounts = [NSMutableDictionary dictionary];
+                forumTerms[forumName] = termCounts;
+            }
+            termCounts[term] = @([results intForColumnIndex:2]);
+            hasRows = YES;
+        }
+        [results close];
+    }];
+    
+    [forumTerms enumerateKeysAndObjectsUsingBlock:^(NSString * forumName, NSDictionary * termCounts, BOOL * stop) {
+        [self setTermCounts:termCounts forForum:forumName];
+    }];
+    return hasRows;
+}
+
+/* Write the postings for a single forum. The caller must hold the
+ * database lock.
+ */
+-(void)writeForum:(NSString *)forumName
+{
+    [CIX.DB executeUpdate:@"delete from DirKeyword where forum=?", forumName];
+    for (NSString * term in _termsByForum[forumName])
+        [CIX.DB executeUpdate:@"insert into DirKeyword (term, forum, frequency) values (?, ?, ?)", term, forumName, _postings[term][forumName]];
+}
+
+/* Replace the saved index with this one.
+ */
+-(void)saveAll
+{
+    @synchronized(CIX.DBLock) {
+        @synchronized(self) {
+            [CIX.DB beginTransaction];
+            [CIX.DB executeUpdate:@"delete from DirKeyword"];
+            for (NSString * forumName in _termsByForum)
+                [self writeForum:forumName];
+            [CIX.DB commit];
+        }
+    }
+}
+
+/* Save the postings for a single forum.
+ */
+-(void)saveForum:(NSString *)forumName
+{
+    @synchronized(CIX.DBLock) {
+        @synchronized(self) {
+            [CIX.DB beginTransaction];
+            [self writeForum:forumName];
+            [CIX.DB commit];
+        }
+    }
+}
+@end
+
 @implementation DirectoryCollection
 
 /* Synchronise any offline changes to forums that are moderated by the
@@ -44,7 +382,7 @@
     {
         _indexingEnabled = flag;
         if (_indexingEnabled)
-            [self index];
+            [self loadIndex];
     }
 }
 
@@ -72,7 +410,8 @@
     return _categories.allKeys;
 }
 
-/* Return all forums, loading from the database if required.
+/* Return all forums, loading from the database if required. The array
+ * is built once and then reused until a forum is added.
  */
 -(NSArray *)forums
 {
@@ -81,15 +420,70 @@
         // Ensure categories have been loaded!
         [self categories];
         
+        // Read outside the lock since the read may wait on the database lock
         NSArray * results = [DirForum allRows];
 
-        _forums = [[NSMutableDictionary alloc] init];
-        for (DirForum * forum in results)
+        @synchronized(self) {
+            if (_forums == nil)
+            {
+                _forums = [[NSMutableDictionary alloc] init];
+                _forumsByName = [[NSMutableDictionary alloc] init];
+                _forumsByCategory = [[NSMutableDictionary alloc] init];
+                for (DirForum * forum in results)
+                    [self addForum:forum fromCategory:nil];
+            }
+        }
+    }
+    @synchronized(self) {
+        if (_allForums == nil)
+            _allForums = [_forums allValues];
+        return _allForums;
+    }
+}
+
+/* Add a new forum to the collection and its indexes, or move an existing
+ * one to the category list for its current category.
+ */
+-(void)addForum:(DirForum *)forum fromCategory:(NSString *)oldCategoryName
+{
+    @synchronized(self) {
+        if (_forums[@(forum.ID)] == nil)
+        {
             _forums[@(forum.ID)] = forum;
+            _allForums = nil;
+        }
+        else if (oldCategoryName != nil && ![oldCategoryName isEqualToString:forum.cat])
+            [_forumsByCategory[oldCategoryName] removeObjectIdenticalTo:forum];
+        else
+            return;
         
-        [self index];
+        if (forum.name != nil)
+            _forumsByName[forum.name] = forum;
+        if (forum.cat != nil)
+        {
+            NSMutableArray * categoryForums = _forumsByCategory[forum.cat];
+            if (categoryForums == nil)
+            {
+                categoryForums = [NSMutableArray array];
+                _forumsByCategory[forum.cat] = categoryForums;
+            }
+            [categoryForums addObject:forum];
+        }
+    }
+}
+
+/* Remove a forum from the collection and its indexes.
+ */
+-(void)removeForum:(DirForum *)forum
+{
+    @synchronized(self) {
+        [_forums removeObjectForKey:@(forum.ID)];
+        if (forum.name != nil)
+            [_forumsByName removeObjectForKey:forum.name];
+        if (forum.cat != nil)
+            [_forumsByCategory[forum.cat] removeObjectIdenticalTo:forum];
+        _allForums = nil;
     }
-    return [_forums allValues];
 }
 
 /* Return the DirCategory matching the specified name and subcategory.
@@ -109,13 +503,11 @@
  */
 -(NSArray *)forumsByCategoryName:(NSString *)categoryName
 {
-    NSMutableArray * forums = [NSMutableArray array];
-    for (DirForum * forum in [self forums])
-    {
-        if ([forum.cat isEqualToString:categoryName])
-            [forums addObject:forum];
+    [self forums];
+    @synchronized(self) {
+        NSArray * forums = _forumsByCategory[categoryName];
+        return (forums != nil) ? [forums copy] : [NSArray array];
     }
-    return forums;
 }
 
 /* Return all subcategories belonging to the specified category
@@ -129,107 +521,136 @@
  */
 -(DirForum *)forumByName:(NSString *)name
 {
-    for (DirForum * forum in [self forums])
-    {
-        if ([forum.name isEqualToString:name])
-            return forum;
+    if (name == nil)
+        return nil;
+    
+    [self forums];
+    @synchronized(self) {
+        return _forumsByName[name];
     }
-    return nil;
 }
 
-/* Index all the forum descriptions and generate a dictionary of keywords with
- * an array of forums matching those keywords.
+/** Create the tables that hold the directory keyword index and the state
+ of each category as of the last directory refresh
+ */
++(void)createTables
+{
+    @synchronized(CIX.DBLock) {
+        [CIX.DB executeUpdate:@"create table if not exists DirKeyword (term TEXT NOT NULL, forum TEXT NOT NULL, frequency INTEGER, primary key (term, forum)) without rowid"];
+        [CIX.DB executeUpdate:@"create index if not exists DirKeyword_forum on DirKeyword (forum)"];
+        [CIX.DB executeUpdate:@"create table if not exists DirCategoryState (name TEXT PRIMARY KEY, etag TEXT, hash TEXT)"];
+    }
+}
+
+/** Discard the saved keyword index so that it is built again from the
+ forum descriptions, for when the way terms are derived has changed
+ */
++(void)discardIndex
+{
+    @synchronized(CIX.DBLock) {
+        [CIX.DB executeUpdate:@"delete from DirKeyword"];
+    }
+}
+
+/* Load the keyword index saved by an earlier session, building it from
+ * the forum descriptions instead if none was saved.
+ */
+-(void)loadIndex
+{
+    if (_indexingEnabled)
+        dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            NSDate * startDate = NSDate.date;
+            DirKeywordIndex * keywordIndex = [[DirKeywordIndex alloc] initWithStopWords:[self stopWords]];
+            if (![keywordIndex load])
+            {
+                [self rebuildIndex];
+                return;
+            }
+            @synchronized(self) {
+                self->_keywordIndex = keywordIndex;
+            }
+            [LogFile.logFile writeLine:@"Directory keyword index loaded with %lu terms in %.3f seconds",
+                (unsigned long)keywordIndex.countOfTerms, [NSDate.date timeIntervalSinceDate:startDate]];
+        });
+}
+
+/* Build the keyword index from all the forum descriptions and save it.
  */
--(void)index
+-(void)rebuildIndex
 {
     if (_indexingEnabled)
-        dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
-            self->_indexList = [NSMutableDictionary dictionary];
+        dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+            NSDate * startDate = NSDate.date;
+            DirKeywordIndex * keywordIndex = [[DirKeywordIndex alloc] initWithStopWords:[self stopWords]];
             
-            // Make a copy of the array in case it changes beneath us
-            NSArray * forumsCopy = [[self forums] copy];
-            for (DirForum * forum in forumsCopy)
+            NSArray * forums = [self forums];
+            for (DirForum * forum in forums)
                 if (![forum.desc isBlank])
-                {
-                    NSArray * filteredWords = [self keywordsFromText:forum.desc];
-                    
-                    for (NSString * word in filteredWords)
-                        if (![word isBlank])
-                        {
-                            NSMutableArray * forumList = self->_indexList[word];
-                            if (forumList == nil)
-                            {
-                                forumList = [NSMutableArray array];
-                                self->_indexList[word] = forumList;
-                            }
-                            
-                            if (![forumList containsObject:forum])
-                                [forumList addObject:forum.name];
-                        }
-                }
+                    [keywordIndex setTermCounts:[keywordIndex termCountsFromText:forum.desc] forForum:forum.name];
+            
+            @synchronized(self) {
+                self->_keywordIndex = keywordIndex;
+            }
+            [keywordIndex saveAll];
+            
+            [LogFile.logFile writeLine:@"Directory keyword index built from %lu forums with %lu terms in %.3f seconds",
+                (unsigned long)forums.count, (unsigned long)keywordIndex.countOfTerms, [NSDate.date timeIntervalSinceDate:startDate]];
         });
 }
 
+/* Update the keyword index for a single forum whose description has changed.
+ */
+-(void)indexForum:(DirForum *)forum
+{
+    DirKeywordIndex * keywordIndex;
+    @synchronized(self) {
+        keywordIndex = _keywordIndex;
+    }
+    if (keywordIndex != nil && forum.name != nil)
+    {
+        [keywordIndex setTermCounts:[keywordIndex termCountsFromText:forum.desc] forForum:forum.name];
+        [keywordIndex saveForum:forum.name];
+    }
+}
+
 /** Return an ordered list of forum names matching the keywords in the given text.
  
+ Words in the text match forum descriptions containing the same word or, for
+ words of three or more letters, any word starting with it. The forums are
+ ranked by TF-IDF so that forums using rarer words from the text, and using
+ them more often, come first.
+ 
  @param text The text to parse for keywords
  @return An NSArray of NSString objects representing the forum names
  */
 -(NSArray *)forumsMatchingKeywordsInText:(NSString *)text
 {
-    NSMutableArray * forums = [NSMutableArray array];
-    
-    NSArray * filteredWords = [self keywordsFromText:text];
-    for (NSString * word in filteredWords)
-        if (![word isBlank])
-        {
-            if (_indexList[word] != nil)
-                [forums addObjectsFromArray:_indexList[word]];
-        }
-    
-    // Now forums will contain duplicates so sort them by the number of occurrences
-    // of each forum in the list, common first.
-    NSCountedSet *countedSet = [[NSCountedSet alloc] initWithArray:forums];
-
-    return [[countedSet allObjects] sortedArrayUsingComparator:^NSComparisonResult(NSString * obj1, NSString * obj2) {
-        NSUInteger obj1Count = [countedSet countForObject:obj1];
-        NSUInteger obj2Count = [countedSet countForObject:obj2];
-        
-        if (obj1Count > obj2Count)
-            return NSOrderedAscending;
-        if (obj1Count < obj2Count)
-            return NSOrderedDescending;
-        return NSOrderedSame;
-    }];
-}
-
-/* Return a list of keywords from the given text
- */
--(NSArray *)keywordsFromText:(NSString *)text
-{
-    NSPredicate *intersectPredicate = [NSPredicate predicateWithFormat:@"NOT (SELF IN %@)", [self stopWordList]];
-    
-    NSMutableCharacterSet * separators = [NSMutableCharacterSet characterSetWithCharactersInString:@",;.:() \n\t\r"];
-    
-    NSArray * words = [text componentsSeparatedByCharactersInSet:separators];
-    return [words filteredArrayUsingPredicate:intersectPredicate];
+    DirKeywordIndex * keywordIndex;
+    @synchronized(self) {
+        keywordIndex = _keywordIndex;
+    }
+    return (keywordIndex != nil) ? [keywordIndex forumsMatchingText:text] : [NSArray array];
 }
 
-/* Return the stop word list for the current system language.
+/* Return the stop words for the current system language, folded in the
+ * same way as the indexed words.
  */
--(NSArray *)stopWordList
+-(NSSet *)stopWords
 {
-    if (_stopWordList == nil)
-    {
-        NSBundle * frameworkBundle = [NSBundle bundleForClass:[DirForum class]];
-        NSString * stopwordsFile = [frameworkBundle pathForResource:@"Stopwords" ofType:@"txt"];
-        
-        NSError * error = nil;
-        
-        NSString * fileContents = [NSString stringWithContentsOfFile:stopwordsFile encoding:NSUTF8StringEncoding error:&error];
-        _stopWordList = [fileContents componentsSeparatedByCharactersInSet:[NSCharacterSet newlineCharacterSet]];
+    @synchronized(self) {
+        if (_stopWords == nil)
+        {
+            NSBundle * frameworkBundle = [NSBundle bundleForClass:[DirForum class]];
+            NSString * stopwordsFile = [frameworkBundle pathForResource:@"Stopwords" ofType:@"txt"];
+            
+            NSError * error = nil;
+            
+            NSString * fileContents = [NSString stringWithContentsOfFile:stopwordsFile encoding:NSUTF8StringEncoding error:&error];
+            NSString * foldedContents = [fileContents stringByFoldingWithOptions:NSCaseInsensitiveSearch|NSDiacriticInsensitiveSearch locale:nil];
+            _stopWords = [NSSet setWithArray:[foldedContents componentsSeparatedByCharactersInSet:[NSCharacterSet newlineCharacterSet]]];
+        }
+        return _stopWords;
     }
-    return _stopWordList;
 }
 
 /** Refresh the details for a single forum.
@@ -279,12 +700,9 @@
                                                else
                                                {
                                                    DirForum * forum = [self forumByName:details.Name];
-                                                   BOOL isNewForum = NO;
                                                    if (forum == nil)
-                                                   {
                                                        forum = [[DirForum alloc] init];
-                                                       isNewForum = YES;
-                                                   }
+                                                   NSString * oldCategoryName = forum.cat;
 
                                                    forum.name = details.Name;
                                                    forum.title = details.Title;
@@ -298,8 +716,8 @@
                                                    
                                                    resp.object = forum;
                                                    
-                                                   if (isNewForum)
-                                                       self->_forums[@(forum.ID)] = forum;
+                                                   [self addForum:forum fromCategory:oldCategoryName];
+                                                   [self indexForum:forum];
 
                                                    [LogFile.logFile writeLine:@"Directory for %@ updated", forum.name];
                                                }
@@ -390,85 +808,239 @@
     }
 }
 
-/* For each category, refresh the forums listed in them
+/* Return a hash of the contents of a response that stays the same from
+ * one session to the next, using 64-bit FNV-1a.
+ */
+static NSString * ContentHash(NSData * data)
+{
+    const uint8_t * bytes = data.bytes;
+    uint64_t hash = 14695981039346656037ULL;
+    for (NSUInteger index = 0; index < data.length; ++index)
+    {
+        hash ^= bytes[index];
+        hash *= 1099511628211ULL;
+    }
+    return [NSString stringWithFormat:@"%016llx", hash];
+}
+
+/* Return whether two strings are equal, treating two nil strings as equal.
+ */
+static BOOL SameString(NSString * string1, NSString * string2)
+{
+    return string1 == string2 || [string1 isEqualToString:string2];
+}
+
+/* For each category, refresh the forums listed in them. At most
+ * MaxConcurrentCategoryRequests categories are requested at once and
+ * the changes are applied together once all of them have responded.
  */
 -(void)refreshCategories
 {
-    _categoriesToRefesh = self.categories.count;
-    for (NSString * categoryName in self.categories)
+    NSArray * categoryNames = self.categories;
+    
+    // Get the version of each category seen by the last refresh
+    NSMutableDictionary * categoryStates = [NSMutableDictionary dictionary];
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        FMResultSet * results = [db executeQuery:@"select name, etag, hash from DirCategoryState"];
+        while ([results next])
+        {
+            CategoryListing * state = [CategoryListing new];
+            state.etag = [results stringForColumnIndex:1];
+            state.contentHash = [results stringForColumnIndex:2];
+            categoryStates[[results stringForColumnIndex:0]] = state;
+        }
+        [results close];
+    }];
+    
+    @synchronized(self) {
+        _categoryStates = categoryStates;
+        _pendingCategories = [NSMutableArray arrayWithArray:categoryNames];
+        _categoryListings = [NSMutableDictionary dictionary];
+        _categoriesToRefesh = categoryNames.count;
+    }
+    for (NSUInteger index = 0; index < MaxConcurrentCategoryRequests; ++index)
+        [self requestNextCategory];
+}
+
+/* Request the forums for the next category waiting to be refreshed. The
+ * request is conditional on the category having changed since the last
+ * refresh.
+ */
+-(void)requestNextCategory
+{
+    NSString * categoryName;
+    CategoryListing * state;
+    @synchronized(self) {
+        categoryName = _pendingCategories.firstObject;
+        if (categoryName == nil)
+            return;
+        [_pendingCategories removeObjectAtIndex:0];
+        state = _categoryStates[categoryName];
+    }
+    
+    NSString * safeCategoryName = [categoryName stringByReplacingOccurrencesOfString:@"&" withString:@"+and+"];
+    safeCategoryName = [safeCategoryName stringByAddingPercentEncodingWithAllowedCharacters:[NSCharacterSet URLQueryAllowedCharacterSet]];
+    
+    NSString * url = [NSString stringWithFormat:@"directory/%@/forums", safeCategoryName];
+    NSMutableURLRequest * request = [[APIRequest get:url] mutableCopy];
+    if (request == nil)
     {
-        NSString * safeCategoryName = [categoryName stringByReplacingOccurrencesOfString:@"&" withString:@"+and+"];
-        safeCategoryName = [safeCategoryName stringByAddingPercentEncodingWithAllowedCharacters:[NSCharacterSet URLQueryAllowedCharacterSet]];
-        
-        NSString * url = [NSString stringWithFormat:@"directory/%@/forums", safeCategoryName];
-        NSURLRequest * request = [APIRequest get:url];
+        [self finishCategory:categoryName withListing:nil];
+        return;
+    }
+    if (state.etag != nil)
+        [request setValue:state.etag forHTTPHeaderField:@"If-None-Match"];
 
-        // Spin up one task per category. Is this too much though?
-        NSURLSession * session = [NSURLSession sharedSession];
-        NSURLSessionDataTask * task = [session dataTaskWithRequest:request
-                                                 completionHandler:^(NSData *data, NSURLResponse *response, NSError *error)
+    NSURLSession * session = [NSURLSession sharedSession];
+    NSURLSessionDataTask * task = [session dataTaskWithRequest:request
+                                             completionHandler:^(NSData *data, NSURLResponse *response, NSError *error)
+                                   {
+                                       CategoryListing * result = nil;
+                                       NSHTTPURLResponse * httpResponse = [response isKindOfClass:NSHTTPURLResponse.class] ? (NSHTTPURLResponse *)response : nil;
+                                       
+                                       if (error != nil)
+                                           [CIX reportServerErrors:__PRETTY_FUNCTION__ error:error];
+                                       else if (httpResponse.statusCode != 304)
                                        {
-                                           if (self->_categoriesToRefesh > 0)
-                                               self->_categoriesToRefesh -= 1;
-                                           if (error != nil)
-                                               [CIX reportServerErrors:__PRETTY_FUNCTION__ error:error];
-                                           else
+                                           NSString * contentHash = ContentHash(data);
+                                           if (![contentHash isEqualToString:state.contentHash])
                                            {
                                                JSONModelError * jsonError = nil;
-                                               J_DirListings * categories = [[J_DirListings alloc] initWithData:data error:&jsonError];
+                                               J_DirListings * listing = [[J_DirListings alloc] initWithData:data error:&jsonError];
                                                if (jsonError == nil)
                                                {
-                                                   int countOfNewForums = 0;
-                                                   
-                                                   @synchronized(CIX.DBLock) {
-                                                       [CIX.DB beginTransaction];
-                                                       for (J_Listing * result in categories.Forums)
-                                                       {
-                                                           DirForum * forum = [self forumByName:result.Forum];
-                                                           if (forum == nil)
-                                                           {
-                                                               forum = [[DirForum alloc] init];
-                                                               forum.name = result.Forum;
-                                                           }
-                                                           forum.recent = result.Recent;
-                                                           forum.title = result.Title;
-                                                           forum.type = result.Type;
-                                                           forum.cat = result.Cat;
-                                                           forum.sub = result.Sub;
-                                                           forum.detailsPending = NO;
-                                                           [forum save];
-
-                                                           self->_forums[@(forum.ID)] = forum;
-                                                           ++countOfNewForums;
-                                                       }
-                                                       [CIX.DB commit];
-                                                   }
-                                                   
-                                                   if (countOfNewForums > 0)
-                                                   {
-                                                       [LogFile.logFile writeLine:@"%d forums in category %@", countOfNewForums, categoryName];
-
-                                                       dispatch_async(dispatch_get_main_queue(),^{
-                                                           NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-                                                           [nc postNotificationName:MADirectoryChanged object:categoryName];
-                                                       });
-                                                   }
+                                                   result = [CategoryListing new];
+                                                   result.listing = listing;
+                                                   result.contentHash = contentHash;
+                                                   for (NSString * header in httpResponse.allHeaderFields)
+                                                       if ([header caseInsensitiveCompare:@"ETag"] == NSOrderedSame)
+                                                           result.etag = httpResponse.allHeaderFields[header];
                                                }
                                            }
+                                       }
+                                       [self finishCategory:categoryName withListing:result];
+                                   }];
+    [task resume];
+}
 
-                                           // On the last category, post that the refresh completed
-                                           if (self->_categoriesToRefesh == 0)
-                                           {
-                                               dispatch_async(dispatch_get_main_queue(),^{
-                                                   NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-                                                   [nc postNotificationName:MADirectoryRefreshCompleted object:nil];
-                                               });
-                                               
-                                               // Rebuild the index
-                                               [self index];
-                                           }
-                                       }];
-        [task resume];
+/* Record the outcome of one category request and start the next one, or
+ * apply all the changes if this was the last category.
+ */
+-(void)finishCategory:(NSString *)categoryName withListing:(CategoryListing *)listing
+{
+    BOOL isLastCategory;
+    @synchronized(self) {
+        if (listing != nil)
+            _categoryListings[categoryName] = listing;
+        if (_categoriesToRefesh > 0)
+            _categoriesToRefesh -= 1;
+        isLastCategory = _categoriesToRefesh == 0;
+    }
+    if (isLastCategory)
+        [self applyCategoryListings];
+    else
+        [self requestNextCategory];
+}
+
+/* Apply the listings of all the categories that have changed to the
+ * DirForum table in a single transaction. Only forums that are new or
+ * whose details differ are written, and forums no longer listed in their
+ * category are removed.
+ */
+-(void)applyCategoryListings
+{
+    NSDictionary * listings;
+    NSUInteger countOfCategories = self.categories.count;
+    @synchronized(self) {
+        listings = _categoryListings;
+        _categoryListings = nil;
+        _categoryStates = nil;
     }
+    
+    NSMutableSet * changedCategories = [NSMutableSet set];
+    NSMutableDictionary * listedForums = [NSMutableDictionary dictionary];
+    int countOfAdded = 0;
+    int countOfChanged = 0;
+    int countOfRemoved = 0;
+    
+    // Ensure forums have been loaded!
+    [self forums];
+    
+    @synchronized(CIX.DBLock) {
+        [CIX.DB beginTransaction];
+        
+        for (NSString * categoryName in listings)
+        {
+            CategoryListing * categoryListing = listings[categoryName];
+            NSMutableSet * forumNames = [NSMutableSet set];
+            
+            for (J_Listing * result in categoryListing.listing.Forums)
+            {
+                [forumNames addObject:SafeString(result.Forum)];
+                
+                DirForum * forum = [self forumByName:result.Forum];
+                BOOL isNewForum = forum == nil;
+                if (isNewForum)
+                {
+                    forum = [[DirForum alloc] init];
+                    forum.name = result.Forum;
+                }
+                else if (forum.recent == result.Recent && !forum.detailsPending &&
+                         SameString(forum.title, result.Title) && SameString(forum.type, result.Type) &&
+                         SameString(forum.cat, result.Cat) && SameString(forum.sub, result.Sub))
+                    continue;
+                
+                NSString * oldCategoryName = forum.cat;
+                forum.recent = result.Recent;
+                forum.title = result.Title;
+                forum.type = result.Type;
+                forum.cat = result.Cat;
+                forum.sub = result.Sub;
+                forum.detailsPending = NO;
+                [forum save];
+                
+                [self addForum:forum fromCategory:oldCategoryName];
+                [changedCategories addObject:categoryName];
+                if (isNewForum)
+                    ++countOfAdded;
+                else
+                    ++countOfChanged;
+            }
+            listedForums[categoryName] = forumNames;
+            
+            [CIX.DB executeUpdate:@"insert or replace into DirCategoryState (name, etag, hash) values (?, ?, ?)",
+                categoryName, categoryListing.etag ?: [NSNull null], categoryListing.contentHash];
+        }
+        
+        // Only look for removed forums once every category has been applied so
+        // that a forum which moved category is not seen as removed.
+        for (NSString * categoryName in listedForums)
+        {
+            NSSet * forumNames = listedForums[categoryName];
+            for (DirForum * forum in [self forumsByCategoryName:categoryName])
+                if (![forumNames containsObject:SafeString(forum.name)] && ![forum hasPending])
+                {
+                    [forum delete];
+                    [self removeForum:forum];
+                    [changedCategories addObject:categoryName];
+                    ++countOfRemoved;
+                }
+        }
+        [CIX.DB commit];
+    }
+    
+    [LogFile.logFile writeLine:@"Directory refreshed: %lu of %lu categories changed, %d forums added, %d changed, %d removed",
+        (unsigned long)listings.count, (unsigned long)countOfCategories, countOfAdded, countOfChanged, countOfRemoved];
+    
+    dispatch_async(dispatch_get_main_queue(),^{
+        NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+        for (NSString * categoryName in changedCategories)
+            [nc postNotificationName:MADirectoryChanged object:categoryName];
+        [nc postNotificationName:MADirectoryRefreshCompleted object:nil];
+    });
+    
+    // Rebuild the index
+    if (countOfAdded + countOfChanged + countOfRemoved > 0)
+        [self rebuildIndex];
 }
 @end
@@ -24,7 +24,6 @@ typedef enum {
 @interface Folder : TableBase {
     MessageCollection * _messages;
     NSMutableArray * _children;
-    BOOL _isFolderRefreshing;
     BOOL _refreshRequired;
 }
 
@@ -40,6 +39,7 @@ typedef enum {
 @property BOOL resignPending;
 @property BOOL markReadRangePending;
 @property BOOL deletePending;
+@property NSDate * lastUpdate;
 
 // Accessors
 -(Folder *)parentFolder;
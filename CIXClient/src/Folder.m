@@ -15,6 +15,9 @@
 #import "DateExtensions.h"
 #import "URLSessionExtensions.h"
 
+// Maximum number of messages returned by each refresh request
+static const int RefreshPageSize = 5000;
+
 @implementation Folder
 
 -(id)init
@@ -333,13 +336,10 @@
                                                }
                                                else
                                                {
-                                                   JSONModelError * jsonError = nil;
-                                                   
-                                                   J_MessageResultSet2 * msgs = [[J_MessageResultSet2 alloc] initWithData:data error:&jsonError];
-                                                   if (jsonError != nil)
+                                                   J_MessageStream * msgs = [[J_MessageStream alloc] initWithData:data];
+                                                   [self addMessages:msgs];
+                                                   if (msgs.failed)
                                                        resp.errorCode = CCResponse_NoSuchForum;
-                                                   else
-                                                       [self addMessages:msgs.Messages];
                                                }
                                                
                                                // Notify interested parties that the folder has changed
@@ -421,6 +421,10 @@
  
  Call this method to refresh the folder from the server and retrieve any new
  messages posted since the last refresh.
+
+ The refresh is queued with the folder collection's refresh scheduler ahead
+ of any background refreshes, so it may not start immediately if other
+ topics are already being refreshed.
  
  On completion, a MAFolderRefreshed notification is posted with a Response object where
  the object field is set to the folder and the errorCode field is set to
@@ -439,148 +443,181 @@
         [nc postNotificationName:MAFolderRefreshed object:[Response responseWithObject:self andError:CCResponse_Offline]];
         return;
     }
-    
-    if (_isFolderRefreshing)
-    {
-        NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-        [nc postNotificationName:MAFolderRefreshed object:[Response responseWithObject:self andError:CCResponse_Busy]];
-        return;
-    }
+    [CIX.folderCollection scheduleRefresh:self urgent:YES];
+}
 
+/* Return the request that retrieves the messages for a refresh of this folder.
+ */
+-(NSURLRequest *)refreshRequest
+{
     NSString * url = [NSString stringWithFormat:@"forums/%@/%@/allmessages", self.parentFolder.encodedName, self.name];
 
-    // Get all new messages since the most recent in the folder or, if the folder
-    // is empty, get everything back to the first one.
+    // Get only the messages added or changed since the last refresh. A folder
+    // that has never been refreshed this way gets the last 30 days if it already
+    // has messages, or everything back to the first one if it is empty.
     NSDate * sinceDate = [NSDate dateWithTimeIntervalSince1970:0];
-    if (self.messages.count > 0)
+    if (self.lastUpdate != nil)
+        sinceDate = [[self.lastUpdate fromLocalDate] dateByAddingTimeInterval:-1];
+    else if (self.messages.count > 0)
         sinceDate = [[NSDate date] dateByAddingTimeInterval:-30*24*60*60]; // Last 30 days
 
-    _isFolderRefreshing = YES;
-    NSURLRequest * request = [APIRequest get:url withQuery:[NSString stringWithFormat:@"maxresults=5000&since=%@", [CIX.dateFormatter stringFromDate:sinceDate]]];
-    if (request != nil)
-    {
-        // Since this is an intensive process, we need to notify ahead of time to give UI the
-        // chance to show the appropriate progress feedback.
-        dispatch_async(dispatch_get_main_queue(),^{
-            NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-            [nc postNotificationName:MAFolderRefreshStarted object:self];
-        });
-
-        NSURLSession * session = [NSURLSession sharedSession];
-        NSURLSessionDataTask * task = [session dataTaskWithRequest:request
-                                                 completionHandler:^(NSData *data, NSURLResponse *response, NSError *error)
-                                       {
-                                           Response * resp = [[Response alloc] initWithObject:self];
-                                           if (error != nil)
-                                           {
-                                               [CIX reportServerErrors:__PRETTY_FUNCTION__ error:error];
-                                               resp.errorCode = CCResponse_ServerError;
-                                           }
-                                           else
-                                           {
-                                               JSONModelError * jsonError = nil;
-                                               
-                                               J_MessageResultSet2 * msgs = [[J_MessageResultSet2 alloc] initWithData:data error:&jsonError];
-                                               if (jsonError != nil)
-                                                   resp.errorCode = CCResponse_NoSuchForum;
-                                               else
-                                                   [self addMessages:msgs.Messages];
-                                           }
+    return [APIRequest get:url withQuery:[NSString stringWithFormat:@"maxresults=%d&since=%@", RefreshPageSize, [CIX.dateFormatter stringFromDate:sinceDate]]];
+}
 
-                                           // Notify interested parties that the folder has changed
-                                           dispatch_async(dispatch_get_main_queue(),^{
-                                               NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-                                               [nc postNotificationName:MAFolderRefreshed object:resp];
-                                           });
-                                           
-                                           self->_isFolderRefreshing = NO;
-                                       }];
-        [task resume];
+/* Add or update the messages from a result set in a transaction of
+ * their own.
+ */
+-(void)addMessages:(id<NSFastEnumeration>)messages
+{
+    @synchronized(CIX.DBLock) {
+        [CIX.DB beginTransaction];
+        [self applyMessages:messages count:NULL];
+        [CIX.DB commit];
     }
 }
 
--(void)addMessages:(NSArray *)messages
+/* Add or update the messages from a result set, decoding each one as
+ * it is reached so that the whole set is never held in memory. Existing
+ * messages are only written if something about them has changed. The caller
+ * must hold the database lock and have begun a transaction.
+ *
+ * Returns the latest update time of any message in the set, and the number
+ * of messages in the set through countOfMessages if it is not NULL.
+ */
+-(NSDate *)applyMessages:(id<NSFastEnumeration>)messages count:(int *)countOfMessages
 {
     int previousUnread = self.unread;
+    int countOfAllMessages = 0;
     int countOfNewMessages = 0;
+    int countOfChangedMessages = 0;
+    NSDate * latestUpdate = nil;
+    NSMutableArray * ignoredMessages = [NSMutableArray array];
+    NSMutableArray * priorityMessages = [NSMutableArray array];
     
-    @synchronized(CIX.DBLock) {
-        [CIX.DB beginTransaction];
+    [self.messages beginBulkAdd];
+    for (J_Message2 * msg in messages)
+    {
+        NSDate * lastUpdate = [CIX.CIXDateFormatter dateFromString:msg.LastUpdate];
+        if (lastUpdate != nil && (latestUpdate == nil || [lastUpdate compare:latestUpdate] == NSOrderedDescending))
+            latestUpdate = lastUpdate;
+        ++countOfAllMessages;
         
-        for (J_Message2 * msg in messages)
+        Message * message = [self.messages messageByID:msg.ID];
+        if (message == nil)
         {
-            Message * message = [self.messages messageByID:msg.ID];
-            if (message == nil)
+            message = [Message new];
+            message.remoteID = msg.ID;
+            message.author = msg.Author;
+            message.body = msg.Body;
+            message.date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
+            message.commentID = msg.ReplyTo;
+            message.rootID = msg.RootID;
+            message.topicID = self.ID;
+            message.starred = msg.Starred;
+            message.priority = msg.Priority;
+            message.unread = msg.Unread;
+            
+            [CIX.ruleCollection applyRules:message];
+            
+            [self.messages addInternal:message];
+            
+            if (message.unread)
             {
-                message = [Message new];
-                message.remoteID = msg.ID;
-                message.author = msg.Author;
-                message.body = msg.Body;
-                message.date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
-                message.commentID = msg.ReplyTo;
-                message.rootID = msg.RootID;
-                message.topicID = self.ID;
-                message.starred = msg.Starred;
-                message.priority = msg.Priority;
-                message.unread = msg.Unread;
-                
-                [CIX.ruleCollection applyRules:message];
-                
-                [self.messages addInternal:message];
-                
-                if (message.unread)
-                {
-                    ++self.unread;
-                    if (message.priority)
-                        ++self.unreadPriority;
-                }
-                if (message.ignored)
-                {
-                    NSArray * children = [self.messages childrenOfMessage:message];
-                    for (Message * child in children)
-                        if (![child ignored])
-                            [child innerSetIgnored];
-                }
+                ++self.unread;
                 if (message.priority)
-                {
-                    NSArray * children = [self.messages childrenOfMessage:message];
-                    for (Message * child in children)
-                        if (![child priority])
-                            [child innerSetPriority];
-                }
-                ++countOfNewMessages;
+                    ++self.unreadPriority;
+            }
+            if (message.ignored)
+                [ignoredMessages addObject:message];
+            if (message.priority)
+                [priorityMessages addObject:message];
+            ++countOfNewMessages;
+        }
+        else
+        {
+            BOOL oldState = message.unread;
+            NSDate * date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
+            BOOL isChanged = NO;
+            
+            if (!message.readPending && !message.readLocked && message.unread != msg.Unread)
+            {
+                message.unread = msg.Unread;
+                isChanged = YES;
             }
-            else
+            if (message.starred != msg.Starred)
             {
-                BOOL oldState = message.unread;
-                
-                if (!message.readPending && !message.readLocked)
-                    message.unread = msg.Unread;
                 message.starred = msg.Starred;
-                
-                if (oldState != message.unread && !message.readLocked)
-                {
-                    self.unread += message.unread ? 1 : -1;
-                    if (message.priority)
-                        self.unreadPriority += message.unread ? 1 : -1;
-                }
-                
+                isChanged = YES;
+            }
+            
+            if (oldState != message.unread && !message.readLocked)
+            {
+                self.unread += message.unread ? 1 : -1;
+                if (message.priority)
+                    self.unreadPriority += message.unread ? 1 : -1;
+            }
+            
+            if (![message.body isEqualToString:msg.Body])
+            {
                 message.body = msg.Body;
-                message.date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
+                isChanged = YES;
+            }
+            if (![message.date isEqualToDate:date])
+            {
+                message.date = date;
+                isChanged = YES;
+            }
+            if (isChanged)
+            {
                 [message save];
+                ++countOfChangedMessages;
             }
         }
-        if (previousUnread != self.unread)
-            [self save];
-        
-        [CIX.DB commit];
     }
+    [self.messages endBulkAdd];
+    
+    // Pass ignored and priority on to the replies once every message is in,
+    // so the threaded view is only built once for the whole set.
+    for (Message * message in ignoredMessages)
+        for (Message * child in [self.messages childrenOfMessage:message])
+            if (![child ignored])
+                [child innerSetIgnored];
+    for (Message * message in priorityMessages)
+        for (Message * child in [self.messages childrenOfMessage:message])
+            if (![child priority])
+                [child innerSetPriority];
+    
+    if (previousUnread != self.unread)
+        [self save];
     
     // Don't need to refresh this any more
     _refreshRequired = NO;
     
-    if (countOfNewMessages > 0)
-        [LogFile.logFile writeLine:@"%@/%@ refreshed with %d new messages", self.parentFolder.name, self.name, countOfNewMessages];
+    if (countOfNewMessages > 0 || countOfChangedMessages > 0)
+        [LogFile.logFile writeLine:@"%@/%@ refreshed with %d new and %d changed messages", self.parentFolder.name, self.name, countOfNewMessages, countOfChangedMessages];
+    
+    if (countOfMessages != NULL)
+        *countOfMessages = countOfAllMessages;
+    return latestUpdate;
+}
+
+/* Record that every change to this folder up to the given date has been
+ * retrieved, so that the next refresh only asks for changes after it. The
+ * caller must hold the database lock.
+ *
+ * Returns YES if a refresh of countOfMessages messages filled the page and
+ * moved the date on, in which case there may be more changes to fetch with
+ * another refresh.
+ */
+-(BOOL)advanceLastUpdate:(NSDate *)date afterCount:(int)countOfMessages
+{
+    if (date != nil && (self.lastUpdate == nil || [date compare:self.lastUpdate] == NSOrderedDescending))
+    {
+        self.lastUpdate = date;
+        [self save];
+        return countOfMessages >= RefreshPageSize;
+    }
+    return NO;
 }
 
 /* Resign this folder
@@ -737,7 +774,7 @@
                 NSString * responseString = [APIRequest responseTextFromData:data];
                 if (responseString != nil && [responseString isEqualToString:@"Success"])
                 {
-                    __block int readCount = 0;
+                    NSMutableArray * messages = [NSMutableArray array];
                    
                     // Iterate over the original indexset because we need to exclude messages whose
                     // readPending flag were set after we created the original indexset.
@@ -745,10 +782,10 @@
                         [CIX.DB beginTransaction];
                         [mutableIndexSet enumerateIndexesUsingBlock:^(NSUInteger remoteID, BOOL * stop) {
                             Message * message = [self.messages messageByID:remoteID];
-                            message.readPending = NO;
-                            [message save];
-                            ++readCount;
+                            if (message != nil)
+                                [messages addObject:message];
                         }];
+                        [self.messages clearReadPending:messages];
                        
                         // If we cleared the flag and no new pending read actions arrived
                         // since, persist the flag to the DB.
@@ -758,7 +795,7 @@
                         [CIX.DB commit];
                     }
                     LogFile * log = LogFile.logFile;
-                    [log writeLine:@"Marked %d messages %@ in %@/%@", readCount, rangeType, self.parentFolder.name, self.name];
+                    [log writeLine:@"Marked %d messages %@ in %@/%@", (int)messages.count, rangeType, self.parentFolder.name, self.name];
                 }
             }
         }
@@ -832,19 +869,13 @@
  */
 -(void)markAllReadOnThread:(id)sender
 {
-    NSMutableArray * foldersUpdated = [NSMutableArray array];
+    NSArray * foldersUpdated = nil;
     @synchronized(CIX.DBLock) {
         [CIX.DB beginTransaction];
         
-        NSArray * children = [NSArray arrayWithArray:self.children];
-        for (Folder * child in children)
-        {
-            if ([child internalMarkAllRead])
-                [foldersUpdated addObject:child];
-        }
-        
-        if ([self internalMarkAllRead])
-            [foldersUpdated addObject:self];
+        NSMutableArray * topics = [NSMutableArray arrayWithArray:self.children];
+        [topics addObject:self];
+        foldersUpdated = [CIX.folderCollection markTopicsRead:topics];
 
         [CIX.DB commit];
     }
@@ -857,32 +888,21 @@
     });
 }
 
-/* Internal mark read procedure to mark all messages in this folder
- * as read.
+/* Bring any messages already loaded for this folder into line after all
+ * unread messages have been marked read in the database. Folders whose
+ * messages have not been loaded are left alone.
  */
--(int)internalMarkAllRead
+-(void)markCachedMessagesRead
 {
-    NSArray * messages = [NSArray arrayWithArray:self.messages.allMessages];
-    int countMarkedRead = 0;
-    for (Message * message in messages)
+    for (Message * message in _messages.allMessages)
     {
         if (message.unread && !message.readLocked)
         {
             message.unread = NO;
-            if (message.priority)
-                --self.unreadPriority;
-            --self.unread;
             message.readPending = YES;
-            [message save];
-            ++countMarkedRead;
+            [message markColumnsSaved:@[ @"unread", @"readPending" ]];
         }
     }
-    if (countMarkedRead > 0)
-    {
-        self.markReadRangePending = YES;
-        [self save];
-    }
-    return countMarkedRead;
 }
 
 /* Call superclass to get description format
@@ -9,20 +9,43 @@
 #import "Folder.h"
 #import "Rule.h"
 
+@interface MessageSearchResult : NSObject
+
+@property (nonatomic, readonly) Message * message;
+@property (nonatomic, readonly) NSString * snippet;
+@property (nonatomic, readonly) double rank;
+
+@end
+
 @interface FolderCollection : NSObject <NSFastEnumeration> {
     NSMutableDictionary * _folders;
     NSMutableDictionary * _foldersByName;
     NSArray * _allFolders;
     Folder * _root;
     BOOL _isInRefresh;
+    int _syncPageCount;
+    int _syncMessageCount;
+    NSDate * _syncStartDate;
+    NSDate * _syncEndDate;
+    NSMutableArray * _queuedRefreshes;
+    NSMutableSet * _activeRefreshes;
+    NSMutableArray * _completedRefreshes;
+    dispatch_queue_t _refreshWriteQueue;
+    NSTimeInterval _totalRefreshLatency;
+    int _refreshCount;
 }
 
+// Topic refresh scheduling
+@property (nonatomic) NSUInteger maxConcurrentRefreshes;
+@property (atomic) Folder * visibleFolder;
+
 // Accessors
 -(void)sync;
 -(void)closeSync;
 -(void)refresh:(BOOL)useFastSync;
 -(NSArray *)allFolders;
 -(NSArray *)messagesWithCriteria:(NSString *)criteria;
+-(NSArray *)searchMessages:(NSString *)text fromAuthor:(NSString *)author;
 -(void)add:(Folder *)folder;
 -(void)remove:(Folder *)folder;
 -(BOOL)isJoined:(NSString *)forumName;
@@ -33,4 +56,10 @@
 -(void)refreshInterestingThreads;
 -(void)applyRule:(Rule *)rule;
 -(void)markAllRead;
+-(NSArray *)markTopicsRead:(NSArray *)topics;
+-(double)syncPagesPerSecond;
+-(double)syncMessagesPerSecond;
+-(void)scheduleRefresh:(Folder *)topic urgent:(BOOL)urgent;
+-(NSUInteger)refreshQueueDepth;
+-(NSTimeInterval)averageRefreshLatency;
 @end
@@ -17,6 +17,37 @@
 #import "PredicateExtensions.h"
 #import "CIXThread.h"
 
+// Maximum number of messages requested in each page of a fast sync
+static const int FastSyncPageSize = 5000;
+
+// Maximum number of messages returned by a search
+static const int MaxSearchResults = 500;
+
+// Default number of topic refreshes that may be in flight at once
+static const NSUInteger DefaultMaxConcurrentRefreshes = 4;
+
+/* The outcome of one topic refresh request, held until the next batch
+ * of refreshes is written to the database.
+ */
+@interface TopicRefreshResult : NSObject
+@property (nonatomic) Folder * topic;
+@property (nonatomic) NSData * data;
+@property (nonatomic) NSError * error;
+@property (nonatomic) NSDate * startDate;
+@end
+
+@implementation TopicRefreshResult
+@end
+
+@interface MessageSearchResult ()
+@property (nonatomic, readwrite) Message * message;
+@property (nonatomic, readwrite) NSString * snippet;
+@property (nonatomic, readwrite) double rank;
+@end
+
+@implementation MessageSearchResult
+@end
+
 @implementation FolderCollection
 
 /* Initialise ourself.
@@ -24,8 +55,14 @@
 -(id)init
 {
     if ((self = [super init]) != nil)
+    {
         _foldersByName = [[NSMutableDictionary alloc] init];
-
+        _queuedRefreshes = [[NSMutableArray alloc] init];
+        _activeRefreshes = [[NSMutableSet alloc] init];
+        _completedRefreshes = [[NSMutableArray alloc] init];
+        _refreshWriteQueue = dispatch_queue_create("com.cix.refreshwrite", DISPATCH_QUEUE_SERIAL);
+        _maxConcurrentRefreshes = DefaultMaxConcurrentRefreshes;
+    }
     return self;
 }
 
@@ -122,7 +159,120 @@
  */
 -(NSArray *)messagesWithCriteria:(NSString *)criteria
 {
-    return [self syncWithCache:[Message allRowsWithQuery:[NSString stringWithFormat:@" where %@", criteria]]];
+    return [self syncWithCache:[Message readOnlyRowsWithQuery:[NSString stringWithFormat:@" where %@", criteria]]];
+}
+
+/* Convert free text into an FTS5 query string. Each word is quoted so that
+ * punctuation in the search text is taken literally rather than parsed as
+ * FTS5 syntax, and the resulting phrases must all match.
+ */
+-(NSString *)searchPhrasesFromText:(NSString *)text
+{
+    NSMutableArray * phrases = [NSMutableArray array];
+    for (NSString * word in [text componentsSeparatedByCharactersInSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]])
+        if (word.length > 0)
+            [phrases addObject:[NSString stringWithFormat:@"\"%@\"", [word stringByReplacingOccurrencesOfString:@"\"" withString:@"\"\""]]];
+    return [phrases componentsJoinedByString:@" "];
+}
+
+/* Convert a word into a SQL string literal for a LIKE pattern that
+ * matches the word anywhere in a column.
+ */
+-(NSString *)likePatternForWord:(NSString *)word
+{
+    NSString * pattern = [word stringByReplacingOccurrencesOfString:@"\\" withString:@"\\\\"];
+    pattern = [pattern stringByReplacingOccurrencesOfString:@"%" withString:@"\\%"];
+    pattern = [pattern stringByReplacingOccurrencesOfString:@"_" withString:@"\\_"];
+    pattern = [pattern stringByReplacingOccurrencesOfString:@"'" withString:@"''"];
+    return [NSString stringWithFormat:@"'%%%@%%' escape '\\'", pattern];
+}
+
+/* Search all messages by scanning the message table, for use while the
+ * full-text index is still being built. Every word must appear in the
+ * author or body, and up to MaxSearchResults matches are returned newest
+ * first.
+ */
+-(NSArray *)scanMessages:(NSString *)text fromAuthor:(NSString *)author
+{
+    NSMutableArray * criteria = [NSMutableArray array];
+    NSCharacterSet * separators = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    for (NSString * word in [text componentsSeparatedByCharactersInSet:separators])
+        if (word.length > 0)
+        {
+            NSString * pattern = [self likePatternForWord:word];
+            [criteria addObject:[NSString stringWithFormat:@"(author like %@ or body like %@)", pattern, pattern]];
+        }
+    for (NSString * word in [author componentsSeparatedByCharactersInSet:separators])
+        if (word.length > 0)
+            [criteria addObject:[NSString stringWithFormat:@"author like %@", [self likePatternForWord:word]]];
+    
+    NSString * query = [NSString stringWithFormat:@" where %@ order by date desc limit %d", [criteria componentsJoinedByString:@" and "], MaxSearchResults];
+    NSMutableArray * results = [NSMutableArray array];
+    for (Message * message in [self syncWithCache:[Message readOnlyRowsWithQuery:query]])
+    {
+        MessageSearchResult * result = [MessageSearchResult new];
+        result.message = message;
+        [results addObject:result];
+    }
+    return results;
+}
+
+/** Search all messages using the full-text index
+ 
+ Up to MaxSearchResults matches are returned best first, as ranked by the
+ index, so that only the top hits are loaded. Each result carries
+ the cached Message and a short snippet of the text around the match. Until
+ the index has been built, the messages are scanned instead and the results
+ have no snippet.
+ 
+ @param text The words to search for in the message author or body, or nil
+ @param author The author whose messages are to be matched, or nil
+ @return An NSArray of MessageSearchResult objects
+ */
+-(NSArray *)searchMessages:(NSString *)text fromAuthor:(NSString *)author
+{
+    NSMutableArray * terms = [NSMutableArray array];
+    NSString * phrases = [self searchPhrasesFromText:text];
+    if (phrases.length > 0)
+        [terms addObject:phrases];
+    NSString * authorPhrase = [self searchPhrasesFromText:author];
+    if (authorPhrase.length > 0)
+        [terms addObject:[NSString stringWithFormat:@"author : (%@)", authorPhrase]];
+    if (terms.count == 0)
+        return @[];
+    if (![Message isSearchIndexReady])
+        return [self scanMessages:text fromAuthor:author];
+    
+    NSString * searchTable = [Message searchTableName];
+    NSString * matchString = [terms componentsJoinedByString:@" "];
+    NSMutableArray * results = [NSMutableArray array];
+    NSMutableDictionary * resultsByID = [NSMutableDictionary dictionary];
+    
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        FMResultSet * rows = [db executeQuery:[NSString stringWithFormat:@"select rowid, snippet(%@, -1, '', '', '...', 16), bm25(%@) from %@ where %@ match ? order by rank limit ?",
+                                               searchTable, searchTable, searchTable, searchTable], matchString, @(MaxSearchResults)];
+        while ([rows next])
+        {
+            MessageSearchResult * result = [MessageSearchResult new];
+            result.snippet = [rows stringForColumnIndex:1];
+            result.rank = [rows doubleForColumnIndex:2];
+            [results addObject:result];
+            resultsByID[@([rows longLongIntForColumnIndex:0])] = result;
+        }
+        [rows close];
+    }];
+    if (results.count == 0)
+        return results;
+    
+    NSString * idList = [resultsByID.allKeys componentsJoinedByString:@","];
+    for (Message * message in [self syncWithCache:[Message readOnlyRowsWithQuery:[NSString stringWithFormat:@" where ID in (%@)", idList]]])
+    {
+        MessageSearchResult * result = resultsByID[@(message.ID)];
+        result.message = message;
+    }
+    
+    // Drop any hit whose message went away between the two queries
+    return [results filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"message != nil"]];
 }
 
 /* Add one folder to the folder collection as loaded from
@@ -146,11 +296,87 @@
  */
 -(void)markAllRead
 {
-    for (Folder * folder in _folders.allValues)
+    NSThread * myThread = [[NSThread alloc] initWithTarget:self selector:@selector(markAllReadOnThread:) object:nil];
+    [myThread start];
+}
+
+/* Run a mark all read on every folder within a thread.
+ */
+-(void)markAllReadOnThread:(id)sender
+{
+    NSArray * foldersUpdated = nil;
+    @synchronized(CIX.DBLock) {
+        [CIX.DB beginTransaction];
+        foldersUpdated = [self markTopicsRead:nil];
+        [CIX.DB commit];
+    }
+    
+    // Notify about the change to the folders
+    dispatch_async(dispatch_get_main_queue(),^{
+        NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+        for (Folder * folder in foldersUpdated)
+            [nc postNotificationName:MAFolderRefreshed object:[Response responseWithObject:folder andError:CCResponse_NoError]];
+    });
+}
+
+/** Mark all messages in the specified topics read
+ 
+ The unread messages are counted and marked read with one statement
+ each, regardless of the number of messages, and the folder counts are
+ then adjusted from the totals. Read-locked messages are not changed.
+ Must be called within a transaction.
+ 
+ @param topics An NSArray of folders to mark read, or nil for all folders
+ @return An NSArray of the folders whose messages were changed
+ */
+-(NSArray *)markTopicsRead:(NSArray *)topics
+{
+    NSMutableArray * foldersUpdated = [NSMutableArray array];
+    NSString * condition = @"unread=1 and readLocked=0";
+    
+    if (topics != nil)
+    {
+        if (topics.count == 0)
+            return foldersUpdated;
+        
+        NSMutableArray * topicIDs = [NSMutableArray arrayWithCapacity:topics.count];
+        for (Folder * topic in topics)
+            [topicIDs addObject:[@(topic.ID) stringValue]];
+        condition = [condition stringByAppendingFormat:@" and TopicID in (%@)", [topicIDs componentsJoinedByString:@","]];
+    }
+    
+    NSMutableDictionary * unreadCounts = [NSMutableDictionary dictionary];
+    NSMutableDictionary * priorityCounts = [NSMutableDictionary dictionary];
+    
+    @synchronized(CIX.DBLock) {
+        FMResultSet * results = [CIX.DB executeQuery:[NSString stringWithFormat:@"select TopicID, count(*), sum(priority) from Message where %@ group by TopicID", condition]];
+        while (results != nil && [results next])
+        {
+            NSNumber * topicID = @([results longLongIntForColumnIndex:0]);
+            unreadCounts[topicID] = @([results intForColumnIndex:1]);
+            priorityCounts[topicID] = @([results intForColumnIndex:2]);
+        }
+        [results close];
+        
+        if (unreadCounts.count > 0)
+            [CIX.DB executeUpdate:[NSString stringWithFormat:@"update Message set unread=0, readPending=1 where %@", condition]];
+    }
+    
+    for (NSNumber * topicID in unreadCounts)
     {
-        if (folder.unread)
-            [folder markAllRead];
+        Folder * folder = [self folderByID:topicID.longLongValue];
+        if (folder == nil)
+            continue;
+        
+        folder.unread = MAX(0, folder.unread - [unreadCounts[topicID] intValue]);
+        folder.unreadPriority = MAX(0, folder.unreadPriority - [priorityCounts[topicID] intValue]);
+        folder.markReadRangePending = YES;
+        [folder save];
+        [folder markCachedMessagesRead];
+        
+        [foldersUpdated addObject:folder];
     }
+    return foldersUpdated;
 }
 
 /** Add this folder to the FolderCollection
@@ -379,6 +605,11 @@
 }
 
 /** Sync with the API server using the Fast Sync mechanism.
+ 
+ Changes are fetched in pages of up to FastSyncPageSize messages, each one
+ starting from the latest update in the page before. After each page is
+ committed, the point reached is saved as the sync cursor so that a sync
+ that is interrupted resumes from there rather than starting over.
 
  @return YES if the sync was able to complete, NO if we need to fall back on slow sync.
  */
@@ -394,14 +625,58 @@
     if ([sinceDate compare:[NSDate.date dateByAddingTimeInterval:-(60*60*24*30)]] == NSOrderedAscending)
         return NO;
     
-    NSURLRequest * request = [APIRequest get:@"user/sync" withQuery:[NSString stringWithFormat:@"since=%@&maxresults=5000", [CIX.dateFormatter stringFromDate:sinceDate]]];
-    if (request != nil)
+    _isInRefresh = YES;
+    
+    LogFile * log = LogFile.logFile;
+    [log writeLine:@"Sync all forums started"];
+    
+    // Pick up from where an interrupted sync left off
+    NSDate * syncCursor = CIX.syncCursor;
+    if (syncCursor != nil && [syncCursor compare:sinceDate] == NSOrderedDescending)
     {
-        _isInRefresh = YES;
+        [log writeLine:@"Resuming sync from %@", [CIX.dateFormatter stringFromDate:syncCursor]];
+        sinceDate = syncCursor;
+    }
+    
+    _syncPageCount = 0;
+    _syncMessageCount = 0;
+    _syncStartDate = NSDate.date;
+    _syncEndDate = nil;
+    
+    [self fastSyncPageSince:sinceDate needFullSync:NO];
+    return YES;
+}
 
-        LogFile * log = LogFile.logFile;
-        [log writeLine:@"Sync all forums started"];
-        
+/** Return the rate at which pages were synced by the last fast sync
+ 
+ @return The number of pages per second, or 0 if no sync has run.
+ */
+-(double)syncPagesPerSecond
+{
+    NSTimeInterval elapsed = [(_syncEndDate ?: NSDate.date) timeIntervalSinceDate:_syncStartDate];
+    return (_syncStartDate != nil && elapsed > 0) ? _syncPageCount / elapsed : 0;
+}
+
+/** Return the rate at which messages were synced by the last fast sync
+ 
+ @return The number of messages per second, or 0 if no sync has run.
+ */
+-(double)syncMessagesPerSecond
+{
+    NSTimeInterval elapsed = [(_syncEndDate ?: NSDate.date) timeIntervalSinceDate:_syncStartDate];
+    return (_syncStartDate != nil && elapsed > 0) ? _syncMessageCount / elapsed : 0;
+}
+
+/* Fetch and apply one page of fast sync changes since the given date, then
+ * move on to the next page if this one was full. The refresh flag stays set
+ * until the last page is done or the sync stops on an error, so that another
+ * refresh cannot start a second chain of pages from the same cursor.
+ */
+-(void)fastSyncPageSince:(NSDate *)sinceDate needFullSync:(BOOL)previousNeedFullSync
+{
+    NSURLRequest * request = [APIRequest get:@"user/sync" withQuery:[NSString stringWithFormat:@"since=%@&maxresults=%d", [CIX.dateFormatter stringFromDate:sinceDate], FastSyncPageSize]];
+    if (request != nil)
+    {
         // Mark the last sync date
         __block NSDate * latestDate = [sinceDate toLocalDate];
         
@@ -414,141 +689,180 @@
                                            {
                                                [CIX reportServerErrors:__PRETTY_FUNCTION__ error:error];
                                                resp.errorCode = CCResponse_ServerError;
+                                               self->_isInRefresh = NO;
                                            }
                                            else
                                            {
-                                               JSONModelError * jsonError = nil;
                                                NSMutableArray * changedFolders = [NSMutableArray array];
                                                NSMutableArray * topicsToRefresh = [NSMutableArray array];
                                                int countOfNewMessages = 0;
-                                               BOOL needFullSync = NO;
+                                               int countOfMessages = 0;
+                                               BOOL needFullSync = previousNeedFullSync;
                                                
-                                               J_MessageResultSet2 * msgs = [[J_MessageResultSet2 alloc] initWithData:data error:&jsonError];
-                                               if (jsonError != nil)
-                                                   resp.errorCode = CCResponse_NoSuchForum;
-                                               else
-                                               {
-                                                   @synchronized(CIX.DBLock) {
-                                                       [CIX.DB beginTransaction];
+                                               // Messages are decoded one at a time as they are written to the
+                                               // database rather than all at once up front.
+                                               J_MessageStream * msgs = [[J_MessageStream alloc] initWithData:data];
+                                               @synchronized(CIX.DBLock) {
+                                                   [CIX.DB beginTransaction];
+                                                   
+                                                   Folder * previousTopic = nil;
+                                                   NSMutableSet * bulkTopics = [NSMutableSet set];
+                                                   for (J_Message2 * msg in msgs)
+                                                   {
+                                                       ++countOfMessages;
+                                                       
+                                                       NSDate * lastUpdate = [CIX.CIXDateFormatter dateFromString:msg.LastUpdate];
+                                                       if ([lastUpdate compare:latestDate] == NSOrderedDescending)
+                                                           latestDate = lastUpdate;
                                                        
-                                                       Folder * previousTopic = nil;
-                                                       for (J_Message2 * msg in msgs.Messages)
+                                                       // We can only refresh folders that actually exist. If this is a message
+                                                       // in a newly subscribed folder then we need to force a full refresh
+                                                       // instead. Clear the last sync to force a full refresh next time.
+                                                       Folder * forum = [self folderByName:msg.Forum];
+                                                       Folder * topic = nil;
+                                                       if (forum != nil)
+                                                           topic = [forum childByName:msg.Topic];
+                                                       
+                                                       if (topic == nil)
+                                                       {
+                                                           needFullSync = YES;
+                                                           continue;
+                                                       }
+                                                       if (topic.messages.count == 0)
                                                        {
-                                                           // We can only refresh folders that actually exist. If this is a message
-                                                           // in a newly subscribed folder then we need to force a full refresh
-                                                           // instead. Clear the last sync to force a full refresh next time.
-                                                           Folder * forum = [self folderByName:msg.Forum];
-                                                           Folder * topic = nil;
-                                                           if (forum != nil)
-                                                               topic = [forum childByName:msg.Topic];
+                                                           // Empty folders require a full refresh on the first time.
+                                                           if (![topicsToRefresh containsObject:topic])
+                                                               [topicsToRefresh addObject:topic];
+                                                           continue;
+                                                       }
+                                                       
+                                                       Message * message = [topic.messages messageByID:msg.ID];
+                                                       if (message == nil)
+                                                       {
+                                                           message = [Message new];
+                                                           message.remoteID = msg.ID;
+                                                           message.author = msg.Author;
+                                                           message.body = msg.Body;
+                                                           message.date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
+                                                           message.commentID = msg.ReplyTo;
+                                                           message.rootID = msg.RootID;
+                                                           message.topicID = topic.ID;
+                                                           message.starred = msg.Starred;
+                                                           message.priority = msg.Priority;
+                                                           message.unread = msg.Unread;
                                                            
-                                                           if (topic == nil)
+                                                           [CIX.ruleCollection applyRules:message];
+                                                           
+                                                           if (![bulkTopics containsObject:topic])
                                                            {
-                                                               needFullSync = YES;
-                                                               continue;
+                                                               [bulkTopics addObject:topic];
+                                                               [topic.messages beginBulkAdd];
                                                            }
-                                                           if (topic.messages.count == 0)
+                                                           [topic.messages addInternal:message];
+                                                           
+                                                           if (message.unread)
                                                            {
-                                                               // Empty folders require a full refresh on the first time.
-                                                               if (![topicsToRefresh containsObject:topic])
-                                                                   [topicsToRefresh addObject:topic];
-                                                               continue;
+                                                               ++topic.unread;
+                                                               if (message.priority)
+                                                                   ++topic.unreadPriority;
                                                            }
+                                                           ++countOfNewMessages;
+                                                       }
+                                                       else
+                                                       {
+                                                           BOOL oldState = message.unread;
                                                            
-                                                           Message * message = [topic.messages messageByID:msg.ID];
-                                                           if (message == nil)
-                                                           {
-                                                               message = [Message new];
-                                                               message.remoteID = msg.ID;
-                                                               message.author = msg.Author;
-                                                               message.body = msg.Body;
-                                                               message.date = [CIX.CIXDateFormatter dateFromString:msg.DateTime];
-                                                               message.commentID = msg.ReplyTo;
-                                                               message.rootID = msg.RootID;
-                                                               message.topicID = topic.ID;
-                                                               message.starred = msg.Starred;
-                                                               message.priority = msg.Priority;
+                                                           if (!message.readPending && !message.readLocked)
                                                                message.unread = msg.Unread;
-                                                               
-                                                               [CIX.ruleCollection applyRules:message];
-                                                               
-                                                               [topic.messages addInternal:message];
-                                                               
-                                                               if (message.unread)
-                                                               {
-                                                                   ++topic.unread;
-                                                                   if (message.priority)
-                                                                       ++topic.unreadPriority;
-                                                               }
-                                                               ++countOfNewMessages;
-                                                           }
-                                                           else
-                                                           {
-                                                               BOOL oldState = message.unread;
-                                                               
-                                                               if (!message.readPending && !message.readLocked)
-                                                                   message.unread = msg.Unread;
-                                                               message.starred = msg.Starred;
-                                                               
-                                                               if (oldState != message.unread && !message.readLocked)
-                                                               {
-                                                                   topic.unread += message.unread ? 1 : -1;
-                                                                   if (message.priority)
-                                                                       topic.unreadPriority += message.unread ? 1 : -1;
-                                                               }
-                                                               
-                                                               message.body = msg.Body;
-                                                               [message save];
-                                                           }
-
-                                                           NSDate * lastUpdate = [CIX.CIXDateFormatter dateFromString:msg.LastUpdate];
-                                                           if (lastUpdate > latestDate)
-                                                               latestDate = lastUpdate;
-
-                                                           // Save the topic when we switch to a new one
-                                                           if (previousTopic != nil && previousTopic != topic)
+                                                           message.starred = msg.Starred;
+                                                           
+                                                           if (oldState != message.unread && !message.readLocked)
                                                            {
-                                                               [changedFolders addObject:previousTopic];
-                                                               [previousTopic save];
+                                                               topic.unread += message.unread ? 1 : -1;
+                                                               if (message.priority)
+                                                                   topic.unreadPriority += message.unread ? 1 : -1;
                                                            }
-                                                           previousTopic = topic;
+                                                           
+                                                           message.body = msg.Body;
+                                                           [message save];
                                                        }
-                                                       
-                                                       if (previousTopic != nil)
+
+                                                       // Save the topic when we switch to a new one
+                                                       if (previousTopic != nil && previousTopic != topic)
                                                        {
-                                                           [previousTopic save];
                                                            [changedFolders addObject:previousTopic];
+                                                           [previousTopic save];
                                                        }
-
-                                                       [CIX.DB commit];
+                                                       previousTopic = topic;
                                                    }
                                                    
-                                                   [LogFile.logFile writeLine:@"Sync completed with %d new messages", countOfNewMessages];
-                                                   
-                                                   // Set the next sync date to the latest update plus 1 second
-                                                   [CIX setLastSyncDate:needFullSync ?
-                                                        [NSDate defaultDate] :
-                                                        [[latestDate fromLocalDate] dateByAddingTimeInterval:-1]];
-                                                   
-                                                   // Refresh each topic that requires refreshing
-                                                   for (Folder * topic in topicsToRefresh)
-                                                       [topic refresh];
-
-                                                   // Notify interested parties that each folder has changed
-                                                   for (Folder * folder in changedFolders)
+                                                   if (previousTopic != nil)
                                                    {
-                                                       dispatch_async(dispatch_get_main_queue(),^{
-                                                           NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
-                                                           resp.object = folder;
-                                                           [nc postNotificationName:MAFolderRefreshed object:resp];
-                                                       });
+                                                       [previousTopic save];
+                                                       [changedFolders addObject:previousTopic];
                                                    }
+                                                   for (Folder * topic in bulkTopics)
+                                                       [topic.messages endBulkAdd];
+
+                                                   [CIX.DB commit];
                                                }
+                                               
+                                               ++self->_syncPageCount;
+                                               self->_syncMessageCount += countOfMessages;
+                                               [LogFile.logFile writeLine:@"Sync page %d completed with %d new messages", self->_syncPageCount, countOfNewMessages];
+                                               
+                                               // A folder that could not be synced needs a full sync, so record that now
+                                               // in case the rest of the sync is interrupted.
+                                               if (needFullSync && !previousNeedFullSync)
+                                                   [CIX setLastSyncDate:[NSDate defaultDate]];
+                                               
+                                               // The next sync starts from the latest update minus 1 second. A full page
+                                               // means there may be more, so save our place and fetch the next page,
+                                               // unless the page made no progress. If the response was cut short,
+                                               // leave the cursor at the last page so the next sync fetches the rest.
+                                               NSDate * nextDate = [[latestDate fromLocalDate] dateByAddingTimeInterval:-1];
+                                               BOOL hasMorePages = NO;
+                                               if (msgs.failed)
+                                               {
+                                                   resp.errorCode = CCResponse_NoSuchForum;
+                                                   self->_isInRefresh = NO;
+                                               }
+                                               else if (countOfMessages >= FastSyncPageSize && [nextDate compare:sinceDate] == NSOrderedDescending)
+                                               {
+                                                   [CIX setSyncCursor:nextDate];
+                                                   hasMorePages = YES;
+                                               }
+                                               else
+                                               {
+                                                   [CIX setLastSyncDate:needFullSync ? [NSDate defaultDate] : nextDate];
+                                                   self->_syncEndDate = NSDate.date;
+                                                   [LogFile.logFile writeLine:@"Sync completed with %d messages in %d pages (%.1f messages/sec)",
+                                                       self->_syncMessageCount, self->_syncPageCount, [self syncMessagesPerSecond]];
+                                                   self->_isInRefresh = NO;
+                                               }
+                                               
+                                               // Refresh each topic that requires refreshing
+                                               for (Folder * topic in topicsToRefresh)
+                                                   [self scheduleRefresh:topic urgent:NO];
+
+                                               // Notify interested parties that each folder has changed
+                                               for (Folder * folder in changedFolders)
+                                               {
+                                                   dispatch_async(dispatch_get_main_queue(),^{
+                                                       NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+                                                       resp.object = folder;
+                                                       [nc postNotificationName:MAFolderRefreshed object:resp];
+                                                   });
+                                               }
+                                               
+                                               if (hasMorePages)
+                                                   [self fastSyncPageSince:nextDate needFullSync:needFullSync];
                                            }
                                        }];
         [task resume];
     }
-    return YES;
+    else
+        _isInRefresh = NO;
 }
 
 /** Refresh the folders collection
@@ -561,11 +875,9 @@
     if (!CIX.online || _isInRefresh)
         return;
     
+    // Fast sync clears the refresh flag itself once its last page is done
     if (useFastSync && [self refreshWithFastSync])
-    {
-        _isInRefresh = NO;
         return;
-    }
     
     NSURLRequest * request = [APIRequest get:@"user/alltopics" withQuery:@"maxresults=5000"];
     if (request != nil)
@@ -594,6 +906,7 @@
                                                {
                                                    NSMutableArray * topicsToRefresh = [NSMutableArray array];
                                                    NSMutableArray * allForums = [NSMutableArray array];
+                                                   NSMutableDictionary * unreadDeltas = [NSMutableDictionary dictionary];
                                                    int newTopics = 0;
                                                    
                                                    @synchronized(CIX.DBLock) {
@@ -672,7 +985,10 @@
                                                            }
 
                                                            if (topic.unread != item.UnRead)
+                                                           {
                                                                [topicsToRefresh addObject:topic];
+                                                               unreadDeltas[@(topic.ID)] = @(abs(topic.unread - item.UnRead));
+                                                           }
                                                        }
                                                        [CIX.DB commit];
                                                    }
@@ -690,9 +1006,13 @@
                                                        }
                                                    }
                                                    
-                                                   // Refresh each topic that requires refreshing
+                                                   // Refresh each topic that requires refreshing, starting with
+                                                   // those whose unread count has moved the most.
+                                                   [topicsToRefresh sortUsingComparator:^NSComparisonResult(Folder * topic1, Folder * topic2) {
+                                                       return [unreadDeltas[@(topic2.ID)] compare:unreadDeltas[@(topic1.ID)]];
+                                                   }];
                                                    for (Folder * topic in topicsToRefresh)
-                                                       [topic refresh];
+                                                       [self scheduleRefresh:topic urgent:NO];
                                                    
                                                    // Notify about the change
                                                    if (newTopics > 0)
@@ -715,4 +1035,202 @@
         [task resume];
     }
 }
+
+/** Schedule a refresh of the specified topic
+ 
+ At most maxConcurrentRefreshes topics are refreshed at once and the rest wait
+ in a queue, with the visible topic always taken first. A topic is never
+ queued or refreshed twice at the same time. An urgent refresh, such as one
+ requested by the user, goes to the front of the queue and reports
+ CCResponse_Busy if the topic is already being refreshed.
+ 
+ @param topic The topic to refresh
+ @param urgent YES to refresh ahead of any queued background refreshes
+ */
+-(void)scheduleRefresh:(Folder *)topic urgent:(BOOL)urgent
+{
+    @synchronized(_queuedRefreshes) {
+        if ([_activeRefreshes containsObject:topic])
+        {
+            if (urgent)
+                dispatch_async(dispatch_get_main_queue(),^{
+                    NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+                    [nc postNotificationName:MAFolderRefreshed object:[Response responseWithObject:topic andError:CCResponse_Busy]];
+                });
+            return;
+        }
+        if ([_queuedRefreshes containsObject:topic])
+        {
+            if (!urgent)
+                return;
+            [_queuedRefreshes removeObject:topic];
+        }
+        if (urgent)
+            [_queuedRefreshes insertObject:topic atIndex:0];
+        else
+            [_queuedRefreshes addObject:topic];
+    }
+    [self startQueuedRefreshes];
+}
+
+/** Return the number of topics waiting to be refreshed
+ 
+ @return The count of queued topics, not including those being refreshed.
+ */
+-(NSUInteger)refreshQueueDepth
+{
+    @synchronized(_queuedRefreshes) {
+        return _queuedRefreshes.count;
+    }
+}
+
+/** Return the average time taken to refresh a topic
+ 
+ @return The mean time from the start of a topic refresh request until its
+ messages were written, or 0 if no topic has been refreshed.
+ */
+-(NSTimeInterval)averageRefreshLatency
+{
+    @synchronized(_queuedRefreshes) {
+        return (_refreshCount > 0) ? _totalRefreshLatency / _refreshCount : 0;
+    }
+}
+
+/* Start refreshing queued topics until the concurrency limit is reached.
+ */
+-(void)startQueuedRefreshes
+{
+    NSMutableArray * topicsToStart = [NSMutableArray array];
+    Folder * visibleFolder = self.visibleFolder;
+    
+    @synchronized(_queuedRefreshes) {
+        while (_queuedRefreshes.count > 0 && _activeRefreshes.count < _maxConcurrentRefreshes)
+        {
+            Folder * topic = [_queuedRefreshes containsObject:visibleFolder] ? visibleFolder : _queuedRefreshes.firstObject;
+            [_queuedRefreshes removeObject:topic];
+            [_activeRefreshes addObject:topic];
+            [topicsToStart addObject:topic];
+        }
+    }
+    for (Folder * topic in topicsToStart)
+        [self startRefresh:topic];
+}
+
+/* Issue the request for one topic refresh. The result is queued for the
+ * next database write rather than being written here.
+ */
+-(void)startRefresh:(Folder *)topic
+{
+    NSURLRequest * request = [topic refreshRequest];
+    if (request == nil)
+    {
+        @synchronized(_queuedRefreshes) {
+            [_activeRefreshes removeObject:topic];
+        }
+        [self startQueuedRefreshes];
+        return;
+    }
+    
+    // Since this is an intensive process, we need to notify ahead of time to give UI the
+    // chance to show the appropriate progress feedback.
+    dispatch_async(dispatch_get_main_queue(),^{
+        NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+        [nc postNotificationName:MAFolderRefreshStarted object:topic];
+    });
+    
+    TopicRefreshResult * result = [TopicRefreshResult new];
+    result.topic = topic;
+    result.startDate = NSDate.date;
+    
+    NSURLSession * session = [NSURLSession sharedSession];
+    NSURLSessionDataTask * task = [session dataTaskWithRequest:request
+                                             completionHandler:^(NSData *data, NSURLResponse *response, NSError *error)
+                                   {
+                                       result.data = data;
+                                       result.error = error;
+                                       @synchronized(self->_queuedRefreshes) {
+                                           [self->_completedRefreshes addObject:result];
+                                       }
+                                       dispatch_async(self->_refreshWriteQueue, ^{
+                                           [self writeCompletedRefreshes];
+                                       });
+                                   }];
+    [task resume];
+}
+
+/* Write the messages from every refresh that has completed since the last
+ * write in a single transaction. Refreshes that finish while a write is in
+ * progress are picked up together by the next one.
+ */
+-(void)writeCompletedRefreshes
+{
+    NSArray * results;
+    @synchronized(_queuedRefreshes) {
+        results = [_completedRefreshes copy];
+        [_completedRefreshes removeAllObjects];
+    }
+    if (results.count == 0)
+        return;
+    
+    NSMutableArray * responses = [NSMutableArray arrayWithCapacity:results.count];
+    NSMutableArray * topicsWithMorePages = [NSMutableArray array];
+    
+    @synchronized(CIX.DBLock) {
+        [CIX.DB beginTransaction];
+        for (TopicRefreshResult * result in results)
+        {
+            Response * resp = [[Response alloc] initWithObject:result.topic];
+            if (result.error != nil)
+            {
+                [CIX reportServerErrors:__PRETTY_FUNCTION__ error:result.error];
+                resp.errorCode = CCResponse_ServerError;
+            }
+            else
+            {
+                J_MessageStream * msgs = [[J_MessageStream alloc] initWithData:result.data];
+                int countOfMessages = 0;
+                NSDate * latestUpdate = [result.topic applyMessages:msgs count:&countOfMessages];
+                if (msgs.failed)
+                    resp.errorCode = CCResponse_NoSuchForum;
+                else if ([result.topic advanceLastUpdate:latestUpdate afterCount:countOfMessages])
+                    [topicsWithMorePages addObject:result.topic];
+            }
+            [responses addObject:resp];
+        }
+        [CIX.DB commit];
+    }
+    
+    LogFile * log = LogFile.logFile;
+    NSDate * now = NSDate.date;
+    NSUInteger queueDepth = [self refreshQueueDepth];
+    
+    for (TopicRefreshResult * result in results)
+    {
+        NSTimeInterval latency = [now timeIntervalSinceDate:result.startDate];
+        [log writeLine:@"Refreshed %@/%@ in %.2f seconds (%lu topics in batch, %lu queued)",
+            result.topic.parentFolder.name, result.topic.name, latency, (unsigned long)results.count, (unsigned long)queueDepth];
+        
+        @synchronized(_queuedRefreshes) {
+            [_activeRefreshes removeObject:result.topic];
+            _totalRefreshLatency += latency;
+            ++_refreshCount;
+        }
+    }
+    
+    // Notify interested parties that the folders have changed
+    for (Response * resp in responses)
+    {
+        dispatch_async(dispatch_get_main_queue(),^{
+            NSNotificationCenter * nc = [NSNotificationCenter defaultCenter];
+            [nc postNotificationName:MAFolderRefreshed object:resp];
+        });
+    }
+    
+    // A full page means there may be more changes, so fetch the next page
+    // from where this one finished.
+    for (Folder * topic in topicsWithMorePages)
+        [self scheduleRefresh:topic urgent:NO];
+    
+    [self startQueuedRefreshes];
+}
 @end
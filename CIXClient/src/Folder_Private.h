@@ -15,6 +15,10 @@
  */
 @interface Folder (Private)
     -(void)sync;
+    -(void)markCachedMessagesRead;
+    -(NSURLRequest *)refreshRequest;
+    -(NSDate *)applyMessages:(id<NSFastEnumeration>)messages count:(int *)countOfMessages;
+    -(BOOL)advanceLastUpdate:(NSDate *)date afterCount:(int)countOfMessages;
 @end
 
 #endif
@@ -12,10 +12,13 @@
 
 @property int version;
 @property NSDate * lastSyncDate;
+@property NSDate * syncCursor;
 
 // Accessors
 -(int)databaseVersion;
 -(void)setDatabaseVersion:(int)value;
 -(NSDate *)databaseLastSyncDate;
 -(void)setDatabaseLastSyncDate:(NSDate *)date;
+-(NSDate *)databaseSyncCursor;
+-(void)setDatabaseSyncCursor:(NSDate *)date;
 @end
@@ -31,6 +31,7 @@
         Global * row = results[0];
         self.version = row.version;
         self.lastSyncDate = row.lastSyncDate;
+        self.syncCursor = row.syncCursor;
     }
     else
     {
@@ -58,11 +59,29 @@
     return self.lastSyncDate;
 }
 
-/* Set the date and time of the last sync.
+/* Set the date and time of the last sync. This supersedes the
+ * cursor of any sync that did not complete.
  */
 -(void)setDatabaseLastSyncDate:(NSDate *)date
 {
     self.lastSyncDate = date;
+    self.syncCursor = nil;
+    [self save];
+}
+
+/* Return the point reached by a sync that has not yet completed, or
+ * nil if there is none.
+ */
+-(NSDate *)databaseSyncCursor
+{
+    return self.syncCursor;
+}
+
+/* Set the point reached by a sync that has not yet completed.
+ */
+-(void)setDatabaseSyncCursor:(NSDate *)date
+{
+    self.syncCursor = date;
     [self save];
 }
 @end
@@ -13,6 +13,13 @@
 
 @implementation MailMessage
 
+/* Index mail messages by their conversation.
+ */
++(NSDictionary *)indexes
+{
+    return @{ @"conversationID" : @"(conversationID)" };
+}
+
 /* Return an empty conversation. The caller must fill out the recipient
  * and subject fields, and add it to the collection.
  */
@@ -12,9 +12,15 @@
 
 @interface Message : TableBase {
     Message * _lastChildMessage;
+    Message * __weak _threadParent;
+    Message * __weak _threadRoot;
     NSMutableArray * _attachments;
     Folder * _folder;
+    NSUInteger _threadIndex;
+    int _descendantCount;
+    int _unreadDescendants;
     int _level;
+    BOOL _unread;
 }
 
 @property ID_type ID;
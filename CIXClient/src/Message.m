@@ -19,6 +19,25 @@
 
 @synthesize topicID = _topicID;
 
+/* Index the topic for folder loads, and the pending and unread flags with
+ * partial indexes so the sync queues only visit the flagged rows.
+ */
++(NSDictionary *)indexes
+{
+    return @{ @"TopicID_remoteID"   : @"(TopicID, remoteID)",
+              @"unread"             : @"(TopicID) where unread=1",
+              @"postPending"        : @"(TopicID) where postPending=1",
+              @"starPending"        : @"(TopicID) where starPending=1",
+              @"withdrawPending"    : @"(TopicID) where withdrawPending=1" };
+}
+
+/* Index the author and body of every message for full-text search.
+ */
++(NSArray *)searchColumns
+{
+    return @[ @"author", @"body" ];
+}
+
 -(void)setLevel:(int)value
 {
     _level = value;
@@ -39,6 +58,74 @@
     return _lastChildMessage;
 }
 
+-(void)setThreadParent:(Message *)parent root:(Message *)root
+{
+    _threadParent = parent;
+    _threadRoot = root;
+}
+
+-(Message *)threadParent
+{
+    return _threadParent;
+}
+
+-(Message *)threadRoot
+{
+    return _threadRoot;
+}
+
+-(void)setThreadIndex:(NSUInteger)value
+{
+    _threadIndex = value;
+}
+
+-(NSUInteger)threadIndex
+{
+    return _threadIndex;
+}
+
+-(void)setDescendantCount:(int)count unread:(int)unreadCount
+{
+    _descendantCount = count;
+    _unreadDescendants = unreadCount;
+}
+
+-(int)descendantCount
+{
+    return _descendantCount;
+}
+
+-(int)unreadDescendants
+{
+    return _unreadDescendants;
+}
+
+/** Set the unread state of this message
+ 
+ Changing the unread state also adjusts the unread child count
+ cached on each of the message's ancestors in the threaded view.
+ 
+ @param unread YES to mark the message unread, NO to mark it read
+ */
+-(void)setUnread:(BOOL)unread
+{
+    if (_unread != unread)
+    {
+        _unread = unread;
+        for (Message * ancestor = _threadParent; ancestor != nil; ancestor = ancestor->_threadParent)
+            ancestor->_unreadDescendants += unread ? 1 : -1;
+    }
+}
+
+/** Return the unread state of this message
+ 
+ @return YES if the message is unread, NO otherwise.
+ */
+-(BOOL)unread
+{
+    return _unread;
+}
+
 /** Return whether this message has child messages
  
  @return YES if the message has children, NO otherwise.
@@ -54,13 +141,7 @@
  */
 -(int)unreadChildren
 {
-    int unreadCount = 0;
-    for (Message * child in [_folder.messages childrenOfMessage:self])
-    {
-        if (child.unread)
-            ++unreadCount;
-    }
-    return unreadCount;
+    return [_folder.messages unreadChildrenOfMessage:self];
 }
 
 /** Return the root of this message
@@ -69,10 +150,8 @@
  */
 -(Message *)root
 {
-    Message * message = self;
-    while (message.level != 0)
-        message = message.parent;
-    return message;
+    Message * root = [_folder.messages rootOfMessage:self];
+    return (root != nil) ? root : self;
 }
 
 /** Return the parent of this message
@@ -438,28 +517,14 @@
         int countPriorityMarkedRead = 0;
         
         [CIX.DB beginTransaction];
-        if (!self.readLocked && self.unread)
+        NSMutableArray * thread = [NSMutableArray arrayWithObject:self];
+        [thread addObjectsFromArray:[_folder.messages childrenOfMessage:self]];
+        
+        for (Message * message in [_folder.messages markMessages:thread unread:NO])
         {
-            self.unread = NO;
-            self.readPending = YES;
-            if (self.priority)
+            if (message.priority)
                 ++countPriorityMarkedRead;
             ++countMarkedRead;
-            [self save];
-        }
-        
-        NSArray * children = [_folder.messages childrenOfMessage:self];
-        for (Message * child in children)
-        {
-            if (!child.readLocked && child.unread)
-            {
-                child.unread = NO;
-                child.readPending = YES;
-                if (child.priority)
-                    ++countPriorityMarkedRead;
-                ++countMarkedRead;
-                [child save];
-            }
         }
         if (countMarkedRead > 0)
         {
@@ -485,28 +550,14 @@
         int countPriorityMarkedUnread = 0;
         
         [CIX.DB beginTransaction];
-        if (!self.readLocked && !self.unread)
+        NSMutableArray * thread = [NSMutableArray arrayWithObject:self];
+        [thread addObjectsFromArray:[_folder.messages childrenOfMessage:self]];
+        
+        for (Message * message in [_folder.messages markMessages:thread unread:YES])
         {
-            self.unread = YES;
-            self.readPending = YES;
-            if (self.priority)
+            if (message.priority)
                 ++countPriorityMarkedUnread;
             ++countMarkedUnread;
-            [self save];
-        }
-        
-        NSArray * children = [_folder.messages childrenOfMessage:self];
-        for (Message * child in children)
-        {
-            if (!child.readLocked && !child.unread)
-            {
-                child.unread = YES;
-                child.readPending = YES;
-                if (child.priority)
-                    ++countPriorityMarkedUnread;
-                ++countMarkedUnread;
-                [child save];
-            }
         }
         if (countMarkedUnread > 0)
         {
@@ -577,8 +628,8 @@
 {
     Attachment * attach = [[Attachment alloc] init];
     attach.filename = filename;
-    attach.encodedData = [fileData base64EncodedStringWithOptions:0];
     attach.messageID = self.ID;
+    attach.data = fileData;
     
     if (_attachments == nil)
         _attachments = [[NSMutableArray alloc] init];
@@ -652,7 +703,7 @@
         {
             J_Attachment2 * attach2 = [[J_Attachment2 alloc] init];
             attach2.Filename = attach.filename;
-            attach2.EncodedData = attach.encodedData;
+            attach2.EncodedData = [attach.data base64EncodedStringWithOptions:0];
             [arrayOfAttach2 addObject:attach2];
         }
         message.Attachments = [[NSMutableArray<J_Attachment2, Optional> alloc] initWithArray:arrayOfAttach2];
@@ -703,7 +754,7 @@
                                                                return;
                                                            }
                                                            [self deleteAttachments];
-                                                           self.remoteID = messageID;
+                                                           [self->_folder.messages reindexMessage:self withID:messageID];
                                                            self.postPending = NO;
                                                            self.date = [[NSDate date] UTCtoGMTBST];
                                                            self.body = response.Body;
@@ -11,20 +11,30 @@
 @interface MessageCollection : NSObject {
     NSMutableArray * _threadedMessages;
     NSMutableArray * _messages;
+    NSMutableDictionary * _messagesByID;
+    NSMutableDictionary * _pseudoMessagesByID;
     BOOL _isOrdered;
+    int _bulkAddDepth;
 }
 
 // Accessors
 -(id)initWithArray:(NSArray *)arrayOfMessages;
 -(void)add:(Message *)message;
 -(BOOL)addInternal:(Message *)message;
+-(void)beginBulkAdd;
+-(void)endBulkAdd;
 -(void)delete:(Message *)message;
+-(NSArray *)markMessages:(NSArray *)messages unread:(BOOL)unread;
+-(void)clearReadPending:(NSArray *)messages;
 -(NSUInteger)count;
 -(Message *)messageByID:(ID_type)messageID;
+-(void)reindexMessage:(Message *)message withID:(int)newID;
 -(NSArray *)roots;
 -(NSArray *)orderedMessages;
 -(NSArray *)allMessages;
 -(NSArray *)allmessagesByConversation;
 -(NSArray *)childrenOfMessage:(Message *)message;
+-(int)unreadChildrenOfMessage:(Message *)message;
+-(Message *)rootOfMessage:(Message *)message;
 -(NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])stackbuf count:(NSUInteger)len;
 @end
@@ -7,6 +7,7 @@
 //
 
 #import "CIX.h"
+#import "FMDatabase.h"
 #import "Message_Private.h"
 
 @implementation MessageCollection
@@ -18,11 +19,51 @@
     if ((self = [super init]) != nil)
     {
         _messages = [[NSMutableArray alloc] initWithArray:arrayOfMessages];
+        _messagesByID = [[NSMutableDictionary alloc] initWithCapacity:arrayOfMessages.count];
+        _pseudoMessagesByID = [[NSMutableDictionary alloc] init];
         _isOrdered = NO;
+
+        // Where the database has duplicates, the first one wins here and the
+        // others are weeded out by the sanity check in orderedMessages.
+        for (Message * message in _messages)
+            if ([self indexedMessage:message.remoteID] == nil)
+                [self indexMessage:message];
     }
     return self;
 }
 
+/* Return the index table that holds the specified remote ID. Pseudo
+ * messages are kept apart so they never collide with a genuine remote ID
+ * assigned later by the server.
+ */
+-(NSMutableDictionary *)indexForID:(ID_type)remoteID
+{
+    return (remoteID >= INT32_MAX/2) ? _pseudoMessagesByID : _messagesByID;
+}
+
+/* Return the message in the index with the specified remote ID.
+ */
+-(Message *)indexedMessage:(ID_type)remoteID
+{
+    return [[self indexForID:remoteID] objectForKey:@(remoteID)];
+}
+
+/* Add the message to the remote ID index.
+ */
+-(void)indexMessage:(Message *)message
+{
+    [[self indexForID:message.remoteID] setObject:message forKey:@(message.remoteID)];
+}
+
+/* Remove the message from the remote ID index if it is the indexed
+ * copy for its remote ID.
+ */
+-(void)unindexMessage:(Message *)message
+{
+    if ([self indexedMessage:message.remoteID] == message)
+        [[self indexForID:message.remoteID] removeObjectForKey:@(message.remoteID)];
+}
+
 /** Add the message to the collection
  
  If the remoteID is set to 0, the message will be posted to the server on the next
@@ -79,8 +120,11 @@
         [message save];
     else
     {
+        int lastRemoteID = _messages.count > 0 ? ((Message *)[_messages lastObject]).remoteID : 0;
+
         [message save];
         [_messages addObject:message];
+        [self indexMessage:message];
 
         // Save any attachments
         for (Attachment * attach in message.attachments)
@@ -89,15 +133,38 @@
             [attach save];
         }
         
-        int lastRemoteID = _messages.count > 0 ? ((Message *)[_messages lastObject]).remoteID : 0;
-        _isOrdered = message.remoteID > lastRemoteID;
-        _threadedMessages = nil;
+        _isOrdered = _isOrdered && message.remoteID > lastRemoteID;
+
+        // A message that arrives in order can be spliced into the existing
+        // threaded view. Anything else, or any message added in bulk, forces
+        // a rebuild on next use.
+        if (!_isOrdered || _bulkAddDepth > 0 || ![self threadMessage:message])
+            _threadedMessages = nil;
         
         isNew = YES;
     }
     return isNew;
 }
 
+/** Start adding a batch of messages to the collection
+ 
+ Splicing a message into the threaded view shifts every message after it,
+ so while a batch is being added the threaded view is dropped instead and
+ built once when it is next used. Each call must be balanced by a call to
+ endBulkAdd.
+ */
+-(void)beginBulkAdd
+{
+    ++_bulkAddDepth;
+}
+
+/** Finish adding a batch of messages to the collection
+ */
+-(void)endBulkAdd
+{
+    --_bulkAddDepth;
+}
+
 /** Delete this message from the collection
  
  @param message The message to be deleted
@@ -107,7 +174,9 @@
     if ([_messages containsObject:message])
     {
         [_messages removeObject:message];
-        [_threadedMessages removeObject:message];
+        [self unindexMessage:message];
+        [message setThreadParent:nil root:nil];
+        _threadedMessages = nil;
         [message deleteAttachments];
         [message delete];
         
@@ -117,6 +186,81 @@
     }
 }
 
+/** Mark a set of messages read or unread
+ 
+ Read-locked messages and those already in the requested state are left
+ alone. The rest are changed and flagged as pending for the next sync,
+ then written to the database in one statement per run of consecutive
+ remote IDs. The caller is responsible for adjusting the folder counts.
+ 
+ @param messages An array of messages from this collection
+ @param unread YES to mark the messages unread, NO to mark them read
+ @return An NSArray of the messages whose state was changed
+ */
+-(NSArray *)markMessages:(NSArray *)messages unread:(BOOL)unread
+{
+    NSMutableArray * changedMessages = [NSMutableArray array];
+    for (Message * message in messages)
+    {
+        if (!message.readLocked && message.unread != unread)
+        {
+            message.unread = unread;
+            message.readPending = YES;
+            [changedMessages addObject:message];
+        }
+    }
+    [self updateMessages:changedMessages
+                     set:@"unread=?, readPending=1"
+               arguments:@[ @(unread) ]
+                 columns:@[ @"unread", @"readPending" ]];
+    return changedMessages;
+}
+
+/** Clear the read pending flag on a set of messages
+ 
+ @param messages An array of messages from this collection
+ */
+-(void)clearReadPending:(NSArray *)messages
+{
+    for (Message * message in messages)
+        message.readPending = NO;
+    
+    [self updateMessages:messages
+                     set:@"readPending=0"
+               arguments:@[]
+                 columns:@[ @"readPending" ]];
+}
+
+/* Apply a SET clause to the rows of the specified messages, issuing one
+ * UPDATE per run of consecutive remote IDs, and record the columns as
+ * saved on each message.
+ */
+-(void)updateMessages:(NSArray *)messages set:(NSString *)setClause arguments:(NSArray *)arguments columns:(NSArray *)columns
+{
+    if (messages.count == 0)
+        return;
+    
+    NSMutableIndexSet * remoteIDs = [NSMutableIndexSet indexSet];
+    for (Message * message in messages)
+        [remoteIDs addIndex:message.remoteID];
+    
+    ID_type topicID = ((Message *)messages[0]).topicID;
+    NSString * sql = [NSString stringWithFormat:@"update Message set %@ where TopicID=? and remoteID between ? and ?", setClause];
+    
+    @synchronized(CIX.DBLock) {
+        [remoteIDs enumerateRangesUsingBlock:^(NSRange range, BOOL * stop) {
+            NSMutableArray * values = [NSMutableArray arrayWithArray:arguments];
+            [values addObject:@(topicID)];
+            [values addObject:@(range.location)];
+            [values addObject:@(NSMaxRange(range) - 1)];
+            [CIX.DB executeUpdate:sql withArgumentsInArray:values];
+        }];
+    }
+    
+    for (Message * message in messages)
+        [message markColumnsSaved:columns];
+}
+
 /* For Message objects that have no remote ID, compute a pseudo value that is
  * unique in the collection until one is assigned by the server.
  *
@@ -149,16 +293,20 @@
         }];
         
         // Sanity check
-        int lastMessageId = -1;
+        Message * lastMessage = nil;
         for (int i = 0; i < _messages.count; i++)
         {
             Message * message = [_messages objectAtIndex:i];
-            if (message.remoteID == lastMessageId)
+            if (lastMessage != nil && message.remoteID == lastMessage.remoteID)
             {
                 [_messages removeObjectAtIndex:i--];
                 [message delete];
+
+                // Make sure the index refers to the copy we kept
+                [self indexMessage:lastMessage];
+                continue;
             }
-            lastMessageId = message.remoteID;
+            lastMessage = message;
         }
         
         _isOrdered = YES;
@@ -176,15 +324,24 @@
  */
 -(Message *)messageByID:(ID_type)messageID
 {
-    for (Message * message in [self orderedMessages])
-    {
-        if (message.remoteID == messageID)
-            return message;
-        
-        if (!message.isPseudo && message.remoteID > messageID)
-            break;
-    }
-    return nil;
+    return [self indexedMessage:messageID];
+}
+
+/** Change the remote ID of a message in the collection
+
+ Use this to assign the server's remote ID to a pseudo message once
+ it has been posted so that the index stays consistent.
+
+ @param message The message whose remote ID is changing
+ @param newID The new remote ID for the message
+ */
+-(void)reindexMessage:(Message *)message withID:(int)newID
+{
+    [self unindexMessage:message];
+    message.remoteID = newID;
+    [self indexMessage:message];
+    _isOrdered = NO;
+    _threadedMessages = nil;
 }
 
 /** Return the total number of messages in the collection
@@ -198,54 +355,135 @@
 
 /** Return an NSArray of all messages ordered by conversation
  
+ The conversation order is built in a single pass over the messages in
+ remote ID order: each message is attached to the list of children of its
+ parent and the result is then walked depth first, assigning the level and
+ last child of each message as it is emitted.
+ 
  @return An NSArray of messages ordered by conversation
  */
 -(NSArray *)allmessagesByConversation
 {
     if (_threadedMessages == nil)
     {
-        NSUInteger index = 0;
-        NSUInteger count = [_messages count];
+        NSArray * messages = [self orderedMessages];
+        NSUInteger count = messages.count;
+        
+        NSMutableArray * roots = [NSMutableArray array];
+        NSMapTable * childrenOfMessage = [NSMapTable strongToStrongObjectsMapTable];
         
-        _threadedMessages = [[NSMutableArray alloc] initWithArray:[self orderedMessages]];
-        while (index < count)
+        // A parent must precede its children in remote ID order otherwise the
+        // child is treated as a root, so only messages already visited are
+        // candidate parents.
+        for (Message * message in messages)
         {
-            Message * message = _threadedMessages[index];
-            message.level = 0;
-            message.lastChildMessage = message;
+            NSMutableArray * siblings = nil;
             if (message.commentID > 0)
             {
-                NSInteger parentIndex = index - 1;
-                while (parentIndex >= 0)
-                {
-                    Message * parentMessage = _threadedMessages[parentIndex];
-                    if (parentMessage.remoteID == message.commentID && parentMessage.topicID == message.topicID)
-                    {
-                        Message * lastChild = parentMessage.lastChildMessage;
-                        
-                        while (lastChild != lastChild.lastChildMessage)
-                            lastChild = lastChild.lastChildMessage;
-
-                        NSUInteger insertIndex = [_threadedMessages indexOfObject:lastChild] + 1;
-                        NSAssert(insertIndex <= index, @"Oops!");
-                        if (insertIndex > 0 && insertIndex != index)
-                        {
-                            [_threadedMessages removeObjectAtIndex:index];
-                            [_threadedMessages insertObject:message atIndex:insertIndex];
-                        }
-                        parentMessage.lastChildMessage = message;
-                        message.level = parentMessage.level + 1;
-                        break;
-                    }
-                    --parentIndex;
-                }
+                Message * parentMessage = [self indexedMessage:message.commentID];
+                if (parentMessage != nil && parentMessage.topicID == message.topicID)
+                    siblings = [childrenOfMessage objectForKey:parentMessage];
+            }
+            [(siblings != nil ? siblings : roots) addObject:message];
+            [childrenOfMessage setObject:[NSMutableArray array] forKey:message];
+        }
+        
+        _threadedMessages = [[NSMutableArray alloc] initWithCapacity:count];
+        
+        NSMutableArray * stack = [NSMutableArray array];
+        for (Message * root in roots.reverseObjectEnumerator)
+        {
+            root.level = 0;
+            [root setThreadParent:nil root:root];
+            [stack addObject:root];
+        }
+        while (stack.count > 0)
+        {
+            Message * message = [stack lastObject];
+            [stack removeLastObject];
+            
+            message.threadIndex = _threadedMessages.count;
+            [message setDescendantCount:0 unread:0];
+            [_threadedMessages addObject:message];
+            
+            NSArray * children = [childrenOfMessage objectForKey:message];
+            message.lastChildMessage = (children.count > 0) ? [children lastObject] : message;
+            for (Message * child in children.reverseObjectEnumerator)
+            {
+                child.level = message.level + 1;
+                [child setThreadParent:message root:message.threadRoot];
+                [stack addObject:child];
             }
-            ++index;
+        }
+        
+        // Every message follows its parent in conversation order, so walking
+        // backwards totals each subtree before its parent is reached.
+        for (Message * message in _threadedMessages.reverseObjectEnumerator)
+        {
+            Message * parentMessage = message.threadParent;
+            if (parentMessage != nil)
+                [parentMessage setDescendantCount:parentMessage.descendantCount + 1 + message.descendantCount
+                                           unread:parentMessage.unreadDescendants + (message.unread ? 1 : 0) + message.unreadDescendants];
         }
     }
     return _threadedMessages;
 }
 
+/* Splice a newly added message into the existing conversation order
+ * without rebuilding it. The message must have the highest remote ID in
+ * the collection so that it is always the last child of its parent.
+ *
+ * Returns NO if the threaded view has not been built yet.
+ */
+-(BOOL)threadMessage:(Message *)message
+{
+    if (_threadedMessages == nil)
+        return NO;
+    
+    Message * parentMessage = (message.commentID > 0) ? [self indexedMessage:message.commentID] : nil;
+    if (parentMessage == message || parentMessage.topicID != message.topicID)
+        parentMessage = nil;
+    
+    if (parentMessage != nil && ![self isThreaded:parentMessage])
+        return NO;
+    
+    message.lastChildMessage = message;
+    [message setDescendantCount:0 unread:0];
+    if (parentMessage == nil)
+    {
+        message.level = 0;
+        message.threadIndex = _threadedMessages.count;
+        [message setThreadParent:nil root:message];
+        [_threadedMessages addObject:message];
+        return YES;
+    }
+    
+    // Insert after the last descendant of the parent and shift the
+    // positions of everything that follows.
+    NSUInteger insertIndex = parentMessage.threadIndex + parentMessage.descendantCount + 1;
+    [_threadedMessages insertObject:message atIndex:insertIndex];
+    for (NSUInteger index = insertIndex; index < _threadedMessages.count; ++index)
+        ((Message *)_threadedMessages[index]).threadIndex = index;
+    
+    parentMessage.lastChildMessage = message;
+    message.level = parentMessage.level + 1;
+    [message setThreadParent:parentMessage root:parentMessage.threadRoot];
+    
+    for (Message * ancestor = parentMessage; ancestor != nil; ancestor = ancestor.threadParent)
+        [ancestor setDescendantCount:ancestor.descendantCount + 1
+                              unread:ancestor.unreadDescendants + (message.unread ? 1 : 0)];
+    return YES;
+}
+
+/* Return whether the message is at its recorded position in the
+ * threaded view.
+ */
+-(BOOL)isThreaded:(Message *)message
+{
+    NSUInteger index = message.threadIndex;
+    return index < _threadedMessages.count && _threadedMessages[index] == message;
+}
+
 /** Return all children of the specified message
  
  Children are all messages which are a direct comment to the
@@ -257,18 +495,35 @@
 -(NSArray *)childrenOfMessage:(Message *)message
 {
     NSArray * conversations = [self allmessagesByConversation];
-    NSInteger index = [conversations indexOfObject:message];
+    if (![self isThreaded:message])
+        return [NSArray array];
     
-    NSMutableArray * children = [NSMutableArray array];
-    
-    while (++index < conversations.count)
-    {
-        Message * child = conversations[index];
-        if (child.level <= message.level)
-            break;
-        [children addObject:child];
-    }
-    return children;
+    return [conversations subarrayWithRange:NSMakeRange(message.threadIndex + 1, message.descendantCount)];
+}
+
+/** Return the number of unread children of the specified message
+ 
+ The count is maintained as messages are marked read or unread so this
+ does not need to visit the children.
+ 
+ @param message The message for which the unread count is required
+ @return The count of unread children
+ */
+-(int)unreadChildrenOfMessage:(Message *)message
+{
+    [self allmessagesByConversation];
+    return [self isThreaded:message] ? message.unreadDescendants : 0;
+}
+
+/** Return the root of the specified message
+ 
+ @param message The message whose root is required
+ @return The root Message of the conversation containing the message
+ */
+-(Message *)rootOfMessage:(Message *)message
+{
+    [self allmessagesByConversation];
+    return [self isThreaded:message] ? message.threadRoot : message;
 }
 
 /** Return all root messages
@@ -36,3 +36,18 @@
 @property (assign, nonatomic) int Start;
 
 @end
+
+@interface J_MessageStream : NSObject <NSFastEnumeration> {
+    NSData * _data;
+    const char * _bytes;
+    NSUInteger _length;
+    NSUInteger _index;
+    BOOL _started;
+    BOOL _finished;
+    J_Message2 * _current;
+}
+
+@property (nonatomic, readonly) BOOL failed;
+
+-(id)initWithData:(NSData *)data;
+@end
@@ -13,3 +13,235 @@
 
 @implementation J_MessageResultSet2
 @end
+
+/* Return the value as a string, or nil if it is null or missing.
+ */
+static inline NSString * stringValue(id value)
+{
+    return [value isKindOfClass:NSString.class] ? value : nil;
+}
+
+/* Return the value as an int, or 0 if it is null or missing.
+ */
+static inline int intValue(id value)
+{
+    return [value isKindOfClass:NSNumber.class] ? [value intValue] : 0;
+}
+
+/* Return the value as a BOOL, or NO if it is null or missing.
+ */
+static inline BOOL boolValue(id value)
+{
+    return [value isKindOfClass:NSNumber.class] ? [value boolValue] : NO;
+}
+
+@implementation J_MessageStream
+
+/** Initialise a stream over a message result set
+ 
+ The stream yields the J_Message2 records of the Messages array in the
+ result set one at a time as it is enumerated. Only the record being
+ enumerated is decoded, so the whole result set is never held as objects.
+ If the data turns out to be malformed, the enumeration stops early and
+ the failed property is set.
+ 
+ @param data The JSON encoded result set
+ @return The initialised stream
+ */
+-(id)initWithData:(NSData *)data
+{
+    if ((self = [super init]) != nil)
+    {
+        _data = data;
+        _bytes = data.bytes;
+        _length = data.length;
+    }
+    return self;
+}
+
+/* Skip whitespace and return the next character, or 0 at the end.
+ */
+-(char)peek
+{
+    while (_index < _length && isspace((unsigned char)_bytes[_index]))
+        ++_index;
+    return (_index < _length) ? _bytes[_index] : 0;
+}
+
+/* Skip past the string that starts at the current index.
+ */
+-(BOOL)skipString
+{
+    for (++_index; _index < _length; ++_index)
+    {
+        if (_bytes[_index] == '\\')
+            ++_index;
+        else if (_bytes[_index] == '"')
+        {
+            ++_index;
+            return YES;
+        }
+    }
+    return NO;
+}
+
+/* Skip past the JSON value that starts at the current index.
+ */
+-(BOOL)skipValue
+{
+    char ch = [self peek];
+    if (ch == '"')
+        return [self skipString];
+    if (ch != '{' && ch != '[')
+    {
+        while (_index < _length && !strchr(",}] \t\r\n", _bytes[_index]))
+            ++_index;
+        return _index < _length;
+    }
+    
+    int depth = 0;
+    while (_index < _length)
+    {
+        ch = _bytes[_index];
+        if (ch == '"')
+        {
+            if (![self skipString])
+                return NO;
+            continue;
+        }
+        if (ch == '{' || ch == '[')
+            ++depth;
+        else if ((ch == '}' || ch == ']') && --depth == 0)
+        {
+            ++_index;
+            return YES;
+        }
+        ++_index;
+    }
+    return NO;
+}
+
+/* Position the stream at the first element of the Messages array. Other
+ * members of the result set are skipped over.
+ */
+-(BOOL)findMessages
+{
+    if ([self peek] != '{')
+        return NO;
+    ++_index;
+    
+    while ([self peek] == '"')
+    {
+        NSUInteger keyStart = _index + 1;
+        if (![self skipString])
+            return NO;
+        BOOL isMessages = (_index - keyStart - 1 == 8) && memcmp(_bytes + keyStart, "Messages", 8) == 0;
+        
+        if ([self peek] != ':')
+            return NO;
+        ++_index;
+        
+        if (isMessages && [self peek] == '[')
+        {
+            ++_index;
+            return YES;
+        }
+        if (![self skipValue])
+            return NO;
+        if ([self peek] == ',')
+            ++_index;
+    }
+    
+    // No messages in this result set
+    _finished = YES;
+    return [self peek] == '}';
+}
+
+/* Decode the next record from the Messages array, or return nil at the end
+ * of the array.
+ */
+-(J_Message2 *)nextMessage
+{
+    char ch = [self peek];
+    if (ch == ',')
+    {
+        ++_index;
+        ch = [self peek];
+    }
+    if (ch == ']')
+    {
+        _finished = YES;
+        return nil;
+    }
+    if (ch != '{')
+    {
+        _failed = YES;
+        return nil;
+    }
+    
+    NSUInteger start = _index;
+    if (![self skipValue])
+    {
+        _failed = YES;
+        return nil;
+    }
+    
+    NSData * recordData = [NSData dataWithBytesNoCopy:(void *)(_bytes + start) length:_index - start freeWhenDone:NO];
+    NSDictionary * record = [NSJSONSerialization JSONObjectWithData:recordData options:0 error:nil];
+    if (![record isKindOfClass:NSDictionary.class])
+    {
+        _failed = YES;
+        return nil;
+    }
+    
+    J_Message2 * msg = [J_Message2 new];
+    msg.Author = stringValue(record[@"Author"]);
+    msg.Body = stringValue(record[@"Body"]);
+    msg.DateTime = stringValue(record[@"DateTime"]);
+    msg.Forum = stringValue(record[@"Forum"]);
+    msg.Topic = stringValue(record[@"Topic"]);
+    msg.LastUpdate = stringValue(record[@"LastUpdate"]);
+    msg.ID = intValue(record[@"ID"]);
+    msg.ReplyTo = intValue(record[@"ReplyTo"]);
+    msg.RootID = intValue(record[@"RootID"]);
+    msg.Priority = boolValue(record[@"Priority"]);
+    msg.Starred = boolValue(record[@"Starred"]);
+    msg.Unread = boolValue(record[@"Unread"]);
+    return msg;
+}
+
+/* Yield the records one at a time. The current record is held by the
+ * stream until the next one is requested.
+ */
+-(NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])stackbuf count:(NSUInteger)len
+{
+    if (state->state == 0)
+    {
+        state->state = 1;
+        state->mutationsPtr = &state->extra[0];
+        if (!_started)
+        {
+            _started = YES;
+            if (![self findMessages])
+            {
+                _failed = YES;
+                _finished = YES;
+            }
+        }
+    }
+    
+    _current = nil;
+    if (_finished || _failed)
+        return 0;
+    
+    @autoreleasepool {
+        _current = [self nextMessage];
+    }
+    if (_current == nil)
+        return 0;
+    
+    stackbuf[0] = _current;
+    state->itemsPtr = stackbuf;
+    return 1;
+}
+@end
@@ -17,6 +17,14 @@
     -(void)setLevel:(int)value;
     -(void)setLastChildMessage:(Message *)value;
     -(Message *)lastChildMessage;
+    -(void)setThreadParent:(Message *)parent root:(Message *)root;
+    -(Message *)threadParent;
+    -(Message *)threadRoot;
+    -(void)setThreadIndex:(NSUInteger)value;
+    -(NSUInteger)threadIndex;
+    -(void)setDescendantCount:(int)count unread:(int)unreadCount;
+    -(int)descendantCount;
+    -(int)unreadDescendants;
     -(int)innerSetIgnored;
     -(void)innerSetPriority;
     -(void)sync;
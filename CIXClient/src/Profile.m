@@ -14,6 +14,14 @@
 
 @implementation Profile
 
+/* Index profiles by username so that a single profile can be looked up
+ * without reading the others. Usernames are not case sensitive.
+ */
++(NSDictionary *)indexes
+{
+    return @{ @"username" : @"(username collate nocase)" };
+}
+
 /** Return the user's friendly name
  
  The user's friendly name is the most visible name. By default it is
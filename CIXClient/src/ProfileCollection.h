@@ -10,7 +10,9 @@
 
 @interface ProfileCollection : NSObject <NSFastEnumeration> {
 @private
-    NSMutableArray * _profiles;
+    NSMutableDictionary * _profilesByName;
+    NSMutableOrderedSet * _recentNames;
+    NSArray * _enumerationProfiles;
 }
 
 // Accessors
@@ -10,6 +10,9 @@
 #import "Mugshot_Private.h"
 #import "Profile_Private.h"
 
+// Maximum number of profiles held in memory
+static const NSUInteger MaxCachedProfiles = 500;
+
 @implementation ProfileCollection
 
 /* Synchronise the profile collection, updating any changes to the local
@@ -34,52 +37,107 @@
     }
 }
 
-/* Return a immutable list of all profiles.
+/* Return the key under which a user's profile is held. Usernames
+ * are not case sensitive.
  */
--(NSMutableArray *)profiles
+static NSString * ProfileKey(NSString * username)
 {
-    if (_profiles == nil)
-        _profiles = [[NSMutableArray alloc] initWithArray:[Profile allRows]];
-
-    return _profiles;
+    return [username lowercaseString];
 }
 
-/* Return the total number of profiles in the collection.
+/* Initialise ourself.
  */
--(NSUInteger)countOfProfiles
+-(id)init
 {
-    return [self.profiles count];
+    if ((self = [super init]) != nil)
+    {
+        _profilesByName = [[NSMutableDictionary alloc] init];
+        _recentNames = [NSMutableOrderedSet orderedSet];
+    }
+    return self;
 }
 
-/* Return the profile at the specified index.
+/* Mark the profile with the given key as the most recently used and drop
+ * the least recently used profiles once there are more than
+ * MaxCachedProfiles. The authenticated user's own profile is always kept.
+ * The caller must hold the collection lock.
  */
--(id)objectInProfilesAtIndex:(NSUInteger)index
+-(void)touchProfileKey:(NSString *)key
 {
-    return self.profiles[index];
+    [_recentNames removeObject:key];
+    [_recentNames addObject:key];
+    
+    NSString * selfKey = ProfileKey(CIX.username);
+    NSUInteger index = 0;
+    while (_recentNames.count > MaxCachedProfiles && index < _recentNames.count)
+    {
+        NSString * oldestKey = _recentNames[index];
+        if ([oldestKey isEqualToString:selfKey])
+        {
+            ++index;
+            continue;
+        }
+        [_profilesByName removeObjectForKey:oldestKey];
+        [_recentNames removeObjectAtIndex:index];
+    }
 }
 
-/* Add a new profile to the database.
+/* Add a new profile to the collection.
  */
 -(void)add:(Profile *)profile
 {
-    [self.profiles addObject:profile];
+    NSString * key = ProfileKey(profile.username);
+    if (key == nil)
+        return;
+    
+    @synchronized(self) {
+        _profilesByName[key] = profile;
+        [self touchProfileKey:key];
+    }
 }
 
-/* Look up a profile for the specified user.
+/* Look up a profile for the specified user, loading it from the database
+ * if it is not already held.
  */
 -(Profile *)get:(NSString *)username
 {
-    for (Profile * profile in self.profiles) {
-        if ([profile.username isEqualToString:username])
-             return profile;
+    NSString * key = ProfileKey(username);
+    if (key == nil)
+        return nil;
+    
+    @synchronized(self) {
+        Profile * profile = _profilesByName[key];
+        if (profile != nil)
+        {
+            [self touchProfileKey:key];
+            return profile;
+        }
+    }
+    
+    NSString * query = [NSString stringWithFormat:@" where username='%@' collate nocase limit 1", [key stringByReplacingOccurrencesOfString:@"'" withString:@"''"]];
+    Profile * profile = [[Profile allRowsWithQuery:query] firstObject];
+    if (profile != nil)
+    {
+        @synchronized(self) {
+            // Keep any copy added while we were reading
+            Profile * existingProfile = _profilesByName[key];
+            if (existingProfile != nil)
+                profile = existingProfile;
+            else
+                _profilesByName[key] = profile;
+            [self touchProfileKey:key];
+        }
     }
-    return nil;
+    return profile;
 }
 
-/* Support fast enumeration on the profiles list.
+/* Support fast enumeration over every profile in the database. The
+ * profiles are read when an enumeration starts rather than held in memory.
  */
 -(NSUInteger)countByEnumeratingWithState:(NSFastEnumerationState *)state objects:(id __unsafe_unretained [])stackbuf count:(NSUInteger)len
 {
-    return [self.profiles countByEnumeratingWithState:state objects:stackbuf count:len];
+    if (state->state == 0)
+        _enumerationProfiles = [Profile allRows];
+    return [_enumerationProfiles countByEnumeratingWithState:state objects:stackbuf count:len];
 }
 @end
@@ -8,16 +8,27 @@
 
 typedef long long int ID_type;
 
-@interface TableBase : NSObject
+@interface TableBase : NSObject {
+    NSArray * _savedValues;
+}
 
 // Accessors
 +(NSString *)tableName;
++(NSUInteger)rowsWritten;
++(unsigned long long)bytesWritten;
++(void)resetWriteCounters;
 +(NSArray *)allRows;
 +(NSArray *)allRowsWithQuery:(NSString *)queryString;
++(NSArray *)readOnlyRowsWithQuery:(NSString *)queryString;
 +(NSInteger)countRowsWithQuery:(NSString *)queryString;
 +(void)create;
++(void)createIndexes;
++(void)createSearchIndex;
++(NSString *)searchTableName;
++(BOOL)isSearchIndexReady;
 +(void)upgrade;
 -(void)save;
 -(void)saveNew;
+-(void)markColumnsSaved:(NSArray *)columnNames;
 -(void)delete;
 @end
@@ -13,6 +13,323 @@
 #import "ImageExtensions.h"
 #import "objc/runtime.h"
 
+// Storage types that a column value can be read as
+typedef enum {
+    ColumnKindString,
+    ColumnKindInt,
+    ColumnKindBool,
+    ColumnKindChar,
+    ColumnKindLongLong,
+    ColumnKindDate,
+    ColumnKindImage
+} ColumnKind;
+
+// A column and the property setter that receives its value
+typedef struct {
+    ColumnKind kind;
+    SEL setter;
+    IMP imp;
+} ColumnSetter;
+
+typedef void (*SetObjectIMP)(id, SEL, id);
+typedef void (*SetIntIMP)(id, SEL, int);
+typedef void (*SetBoolIMP)(id, SEL, BOOL);
+typedef void (*SetCharIMP)(id, SEL, char);
+typedef void (*SetLongLongIMP)(id, SEL, long long);
+
+/* Cached column layout and parameterised SQL for one TableBase class.
+ * Built once on first use so saves and loads don't repeat the property
+ * walk or rebuild the SQL text.
+ */
+@interface TableSchema : NSObject {
+    Class _class;
+    NSArray * _columns;
+    NSArray * _types;
+    NSArray * _allColumns;
+    ColumnSetter * _setters;
+    NSString * _identityColumn;
+    NSString * _insertSQL;
+    NSString * _updateSQL;
+    NSMutableDictionary * _partialUpdateSQL;
+}
+
+-(id)initWithClass:(Class)klass;
+-(NSArray *)columns;
+-(NSArray *)types;
+-(NSString *)identityColumn;
+-(NSString *)insertSQL;
+-(NSString *)updateSQL;
+-(NSString *)updateSQLForColumns:(NSIndexSet *)columnIndexes;
+-(NSArray *)rowsFromResultSet:(FMResultSet *)results;
+@end
+
+@interface TableBase (Private)
+    +(NSDictionary *)classPropsFor:(Class)klass;
+    -(void)markSavedWithValues:(NSArray *)values;
+@end
+
+static NSMutableDictionary * _schemas = nil;
+static NSUInteger _rowsWritten = 0;
+static unsigned long long _bytesWritten = 0;
+
+// Range of row IDs added to a new search index in each background transaction
+static const long long SearchIndexBatchSize = 2000;
+
+@implementation TableSchema
+
+/* Build the schema for the specified class. The identity column is kept
+ * apart from the other columns because it is never written by an insert
+ * and is the key of an update.
+ */
+-(id)initWithClass:(Class)klass
+{
+    if ((self = [super init]) != nil)
+    {
+        NSDictionary * properties = [TableBase classPropsFor:klass];
+        NSString * identityColumn = [klass identityColumn];
+        
+        if (identityColumn != nil && class_getProperty(klass, [identityColumn UTF8String]) == nil)
+            identityColumn = nil;
+        
+        _class = klass;
+        _allColumns = properties.allKeys;
+        _setters = calloc(_allColumns.count, sizeof(ColumnSetter));
+        
+        for (NSUInteger index = 0; index < _allColumns.count; ++index)
+        {
+            NSString * name = _allColumns[index];
+            ColumnSetter * setter = &_setters[index];
+            
+            setter->kind = [self kindForType:properties[name]];
+            setter->setter = NSSelectorFromString([NSString stringWithFormat:@"set%@%@:",
+                                                   [[name substringToIndex:1] uppercaseString],
+                                                   [name substringFromIndex:1]]);
+            setter->imp = [klass instanceMethodForSelector:setter->setter];
+        }
+        
+        NSMutableArray * columns = [NSMutableArray array];
+        NSMutableArray * types = [NSMutableArray array];
+        NSMutableString * updateSQL = [NSMutableString stringWithFormat:@"update %@ set ", [klass tableName]];
+        NSMutableString * insertSQL = [NSMutableString stringWithFormat:@"insert into %@ (", [klass tableName]];
+        NSMutableString * markers = [NSMutableString string];
+        NSString * separator = @"";
+        
+        for (NSString * name in properties.allKeys)
+        {
+            if ([name isEqualToString:identityColumn])
+                continue;
+            
+            [columns addObject:name];
+            [types addObject:properties[name]];
+            
+            [updateSQL appendFormat:@"%@%@=?", separator, name];
+            [insertSQL appendFormat:@"%@%@", separator, name];
+            [markers appendFormat:@"%@?", separator];
+            separator = @",";
+        }
+        [insertSQL appendFormat:@") values (%@)", markers];
+        if (identityColumn != nil)
+            [updateSQL appendFormat:@" where %@=?", identityColumn];
+        
+        _columns = columns;
+        _types = types;
+        _identityColumn = identityColumn;
+        _insertSQL = insertSQL;
+        _updateSQL = updateSQL;
+        _partialUpdateSQL = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+-(void)dealloc
+{
+    free(_setters);
+}
+
+/* Map a property type code to the kind of column value it is read as.
+ */
+-(ColumnKind)kindForType:(NSString *)type
+{
+    if ([type isEqualToString:@"NSString"])
+        return ColumnKindString;
+    if ([type isEqualToString:@"i"])
+        return ColumnKindInt;
+    if ([type isEqualToString:@"B"])
+        return ColumnKindBool;
+    if ([type isEqualToString:@"c"])
+        return ColumnKindChar;
+    if ([type isEqualToString:@"q"])
+        return ColumnKindLongLong;
+    if ([type isEqualToString:@"NSDate"])
+        return ColumnKindDate;
+    if ([type isEqualToString:@"NSImage"])
+        return ColumnKindImage;
+    
+    [NSException raise:@"Unsupported property type" format:@"Type %@ cannot be mapped to a SQLite type", type];
+    return ColumnKindString;
+}
+
+/* Read every row of the result set into a new instance of the class. Column
+ * positions are resolved once per result set and each value is passed to
+ * the property setter in its native type. The values read are also kept as
+ * the row's saved values, so that they need not be read back through the
+ * properties.
+ */
+-(NSArray *)rowsFromResultSet:(FMResultSet *)results
+{
+    NSMutableArray * rows = [NSMutableArray array];
+    NSUInteger count = _allColumns.count;
+    NSUInteger savedCount = _columns.count;
+    int columnIndexes[count];
+    NSUInteger savedIndexes[count];
+    
+    for (NSUInteger index = 0; index < count; ++index)
+    {
+        columnIndexes[index] = [results columnIndexForName:_allColumns[index]];
+        savedIndexes[index] = [_columns indexOfObject:_allColumns[index]];
+    }
+    
+    while ([results next])
+    {
+        id item = [_class new];
+        NSMutableArray * savedValues = [NSMutableArray arrayWithCapacity:savedCount];
+        for (NSUInteger index = 0; index < savedCount; ++index)
+            [savedValues addObject:[NSNull null]];
+        
+        for (NSUInteger index = 0; index < count; ++index)
+        {
+            int columnIndex = columnIndexes[index];
+            NSUInteger savedIndex = savedIndexes[index];
+            id value = nil;
+            
+            // A column missing from the result set leaves the property as it
+            // was, so that is the value to compare against on save.
+            if (columnIndex < 0)
+            {
+                if (savedIndex != NSNotFound)
+                    value = [item valueForKey:_allColumns[index]];
+            }
+            else
+            {
+                ColumnSetter * setter = &_setters[index];
+                switch (setter->kind)
+                {
+                    case ColumnKindString:
+                        value = [results stringForColumnIndex:columnIndex];
+                        ((SetObjectIMP)setter->imp)(item, setter->setter, value);
+                        break;
+                        
+                    case ColumnKindInt: {
+                        int intValue = [results intForColumnIndex:columnIndex];
+                        ((SetIntIMP)setter->imp)(item, setter->setter, intValue);
+                        value = @(intValue);
+                        break;
+                    }
+                        
+                    case ColumnKindBool: {
+                        BOOL boolValue = [results intForColumnIndex:columnIndex] != 0;
+                        ((SetBoolIMP)setter->imp)(item, setter->setter, boolValue);
+                        value = @(boolValue);
+                        break;
+                    }
+                        
+                    case ColumnKindChar: {
+                        char charValue = (char)[results intForColumnIndex:columnIndex];
+                        ((SetCharIMP)setter->imp)(item, setter->setter, charValue);
+                        value = @(charValue);
+                        break;
+                    }
+                        
+                    case ColumnKindLongLong: {
+                        long long longLongValue = [results longLongIntForColumnIndex:columnIndex];
+                        ((SetLongLongIMP)setter->imp)(item, setter->setter, longLongValue);
+                        value = @(longLongValue);
+                        break;
+                    }
+                        
+                    case ColumnKindDate:
+                        value = [results dateForColumnIndex:columnIndex];
+                        ((SetObjectIMP)setter->imp)(item, setter->setter, value);
+                        break;
+                        
+                    case ColumnKindImage:
+                        value = [[ImageClass alloc] initWithData:[results dataForColumnIndex:columnIndex]];
+                        ((SetObjectIMP)setter->imp)(item, setter->setter, value);
+                        break;
+                }
+            }
+            if (savedIndex != NSNotFound && value != nil)
+                savedValues[savedIndex] = value;
+        }
+        [item markSavedWithValues:savedValues];
+        [rows addObject:item];
+    }
+    return rows;
+}
+
+/* Return the names of all non-identity columns.
+ */
+-(NSArray *)columns
+{
+    return _columns;
+}
+
+/* Return the property type codes of the non-identity columns.
+ */
+-(NSArray *)types
+{
+    return _types;
+}
+
+/* Return the identity column name, or nil if the class has none.
+ */
+-(NSString *)identityColumn
+{
+    return _identityColumn;
+}
+
+/* Return the parameterised SQL to insert a new row.
+ */
+-(NSString *)insertSQL
+{
+    return _insertSQL;
+}
+
+/* Return the parameterised SQL to update an existing row.
+ */
+-(NSString *)updateSQL
+{
+    return _updateSQL;
+}
+
+/* Return the parameterised SQL to update just the specified columns of an
+ * existing row. The text is cached per combination of columns so that the
+ * prepared statement is reused.
+ */
+-(NSString *)updateSQLForColumns:(NSIndexSet *)columnIndexes
+{
+    @synchronized(self) {
+        NSString * sql = _partialUpdateSQL[columnIndexes];
+        if (sql == nil)
+        {
+            NSMutableString * updateSQL = [NSMutableString stringWithFormat:@"update %@ set ", [_class tableName]];
+            __block NSString * separator = @"";
+            
+            [columnIndexes enumerateIndexesUsingBlock:^(NSUInteger index, BOOL * stop) {
+                [updateSQL appendFormat:@"%@%@=?", separator, self->_columns[index]];
+                separator = @",";
+            }];
+            if (_identityColumn != nil)
+                [updateSQL appendFormat:@" where %@=?", _identityColumn];
+            
+            sql = updateSQL;
+            _partialUpdateSQL[[columnIndexes copy]] = sql;
+        }
+        return sql;
+    }
+}
+@end
+
 @implementation TableBase
 
 /** Return the SQL table name for this class
@@ -52,6 +369,87 @@
     return NO;
 }
 
+/* Return the cached schema for this class, building it on first use.
+ */
++(TableSchema *)schema
+{
+    @synchronized(TableBase.class) {
+        if (_schemas == nil)
+            _schemas = [NSMutableDictionary dictionary];
+        
+        NSString * className = NSStringFromClass(self.class);
+        TableSchema * schema = _schemas[className];
+        if (schema == nil)
+        {
+            schema = [[TableSchema alloc] initWithClass:self.class];
+            _schemas[className] = schema;
+        }
+        return schema;
+    }
+}
+
+/** Return the secondary indexes for this table
+ 
+ By default a table has no secondary indexes. Subclasses override this to
+ return a dictionary that maps each index name to its parenthesised column
+ list, optionally followed by a WHERE clause to make it a partial index.
+ 
+ @return An NSDictionary of index declarations, or nil.
+ */
++(NSDictionary *)indexes
+{
+    return nil;
+}
+
+/** Return the columns to be covered by a full-text search index
+ 
+ By default a table has no full-text index. Subclasses override this to
+ return the names of the text columns to be indexed.
+ 
+ @return An NSArray of column names, or nil.
+ */
++(NSArray *)searchColumns
+{
+    return nil;
+}
+
+/** Return the name of the full-text search table for this class
+ 
+ @return The name of the FTS5 table that indexes this class.
+ */
++(NSString *)searchTableName
+{
+    return [NSString stringWithFormat:@"%@Search", [self tableName]];
+}
+
+/** Return the number of rows written by save and saveNew
+ 
+ @return The count of rows inserted or updated since the counters were last reset.
+ */
++(NSUInteger)rowsWritten
+{
+    return _rowsWritten;
+}
+
+/** Return the approximate number of bytes written by save and saveNew
+ 
+ @return The total size of all column values written since the counters were last reset.
+ */
++(unsigned long long)bytesWritten
+{
+    return _bytesWritten;
+}
+
+/** Reset the rows and bytes written counters to zero.
+ */
++(void)resetWriteCounters
+{
+    @synchronized(CIX.DBLock) {
+        _rowsWritten = 0;
+        _bytesWritten = 0;
+    }
+}
+
 /** Return an NSArray of all objects from the database
  
  @return An NSArray of objects representing the table type.
@@ -75,58 +473,53 @@
     return count;
 }
 
+/* Read the rows matching a SQL query from the given connection.
+ */
++(NSArray *)rowsWithQuery:(NSString *)queryString fromDatabase:(FMDatabase *)db
+{
+    TableSchema * schema = [self.class schema];
+    NSArray * rows = nil;
+    
+    FMResultSet * results = [db executeQuery:[NSString stringWithFormat:@"select * from %@%@", [self.class tableName], queryString]];
+    if (results != nil)
+    {
+        rows = [schema rowsFromResultSet:results];
+        [results close];
+    }
+    return (rows != nil) ? rows : [NSMutableArray array];
+}
+
 /** Return an NSArray of all objects from the database filtered by a SQL query
 
+ The rows are read on the writer connection so that they include any changes
+ in a transaction that is open on another thread.
+
  @param queryString The SQL condition string to be used to filter the query
  @return An NSArray of objects of the table type.
  */
 +(NSArray *)allRowsWithQuery:(NSString *)queryString
 {
-    NSMutableArray * rows = [NSMutableArray array];
     @synchronized(CIX.DBLock) {
-        FMResultSet * results = [CIX.DB executeQuery:[NSString stringWithFormat:@"select * from %@%@", [self.class tableName], queryString]];
-
-        NSDictionary * properties = [TableBase classPropsFor:self.class];
-        
-        while (results != nil && [results next])
-        {
-            id item = [self.class new];
-            
-            for (NSString * name in properties.allKeys)
-            {
-                NSString * type = [properties valueForKey:name];
-                if ([type isEqualToString:@"NSString"])
-                {
-                    [item setValue:[results stringForColumn:name] forKey:name];
-                    continue;
-                }
-                if ([type isEqualToString:@"i"] || [type isEqualToString:@"B"] || [type isEqualToString:@"c"])
-                {
-                    [item setValue:[NSNumber numberWithInt:[results intForColumn:name]] forKey:name];
-                    continue;
-                }
-                if ([type isEqualToString:@"NSDate"])
-                {
-                    [item setValue:[results dateForColumn:name] forKey:name];
-                    continue;
-                }
-                if ([type isEqualToString:@"q"])
-                {
-                    [item setValue:[NSNumber numberWithLongLong:[results longLongIntForColumn:name]] forKey:name];
-                    continue;
-                }
-                if ([type isEqualToString:@"NSImage"])
-                {
-                    [item setValue:[[ImageClass alloc] initWithData:[results dataForColumn:name]] forKey:name];
-                    continue;
-                }
-                [NSException raise:@"Unsupported property type" format:@"Type %@ cannot be mapped to a SQLite type", type];
-            }
-            
-            [rows addObject:item];
-        }
-        [results close];
+        return [self rowsWithQuery:queryString fromDatabase:CIX.DB];
     }
+}
+
+/** Return an NSArray of objects filtered by a SQL query from a read connection
+
+ The rows are read from the pool of read connections and so do not wait for a
+ transaction open on another thread, but nor do they see its changes. Only use
+ this for results that are shown and then discarded, never for rows that are
+ cached or written back.
+
+ @param queryString The SQL condition string to be used to filter the query
+ @return An NSArray of objects of the table type.
+ */
++(NSArray *)readOnlyRowsWithQuery:(NSString *)queryString
+{
+    __block NSArray * rows = nil;
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        rows = [self rowsWithQuery:queryString fromDatabase:db];
+    }];
     return rows;
 }
 
@@ -195,6 +588,156 @@
     }
 }
 
+/** Create the secondary indexes declared by the class
+ 
+ Each index is only created if it does not already exist so this can be
+ called on every start. It must be called after upgrade so that every
+ indexed column is present in older databases.
+ */
++(void)createIndexes
+{
+    NSDictionary * indexes = [self indexes];
+    for (NSString * name in indexes)
+    {
+        NSString * sqlIndex = [NSString stringWithFormat:@"create index if not exists %@_%@ on %@%@",
+                               [self tableName],
+                               name,
+                               [self tableName],
+                               indexes[name]];
+        @synchronized(CIX.DBLock) {
+            [[CIX DB] executeUpdate:sqlIndex];
+        }
+    }
+}
+
+/** Create the full-text search index declared by the class
+ 
+ The index is an FTS5 table that takes its content from this table and is
+ kept up to date by triggers, so every insert, update and delete on the
+ table is reflected whether it goes through TableBase or not. If the index
+ is being added to an existing database, the rows already present are added
+ in the background and isSearchIndexReady returns NO until they all are.
+ */
++(void)createSearchIndex
+{
+    NSArray * columns = [self searchColumns];
+    if (columns.count == 0)
+        return;
+    
+    NSString * tableName = [self tableName];
+    NSString * searchTable = [self searchTableName];
+    NSString * identity = [self identityColumn];
+    NSString * columnList = [columns componentsJoinedByString:@", "];
+    NSString * newValues = [NSString stringWithFormat:@"new.%@", [columns componentsJoinedByString:@", new."]];
+    NSString * oldValues = [NSString stringWithFormat:@"old.%@", [columns componentsJoinedByString:@", old."]];
+    
+    NSString * sqlInsert = [NSString stringWithFormat:@"insert into %@(rowid, %@) values (new.%@, %@);",
+                            searchTable, columnList, identity, newValues];
+    NSString * sqlDelete = [NSString stringWithFormat:@"insert into %@(%@, rowid, %@) values ('delete', old.%@, %@);",
+                            searchTable, searchTable, columnList, identity, oldValues];
+    
+    // Rows in the range still waiting to be added by populateSearchIndex must
+    // be left to it, as the index cannot delete entries it never had.
+    NSString * (^isIndexed)(NSString *) = ^(NSString * row) {
+        return [NSString stringWithFormat:@"not exists (select 1 from SearchIndexProgress where name='%@' and %@.%@ > indexedID and %@.%@ <= lastID)",
+                searchTable, row, identity, row, identity];
+    };
+    
+    @synchronized(CIX.DBLock) {
+        FMDatabase * db = CIX.DB;
+        [db executeUpdate:@"create table if not exists SearchIndexProgress (name TEXT PRIMARY KEY, indexedID INTEGER, lastID INTEGER)"];
+        
+        if (![db tableExists:searchTable])
+        {
+            [db executeUpdate:[NSString stringWithFormat:@"create virtual table %@ using fts5(%@, content='%@', content_rowid='%@')",
+                               searchTable, columnList, tableName, identity]];
+            [db executeUpdate:[NSString stringWithFormat:@"insert into SearchIndexProgress (name, indexedID, lastID) select ?, 0, ifnull(max(%@), 0) from %@",
+                               identity, tableName], searchTable];
+        }
+        
+        [db executeUpdate:[NSString stringWithFormat:@"drop trigger if exists %@_insert", searchTable]];
+        [db executeUpdate:[NSString stringWithFormat:@"drop trigger if exists %@_delete", searchTable]];
+        [db executeUpdate:[NSString stringWithFormat:@"drop trigger if exists %@_update", searchTable]];
+        [db executeUpdate:[NSString stringWithFormat:@"create trigger %@_insert after insert on %@ when %@ begin %@ end",
+                           searchTable, tableName, isIndexed(@"new"), sqlInsert]];
+        [db executeUpdate:[NSString stringWithFormat:@"create trigger %@_delete after delete on %@ when %@ begin %@ end",
+                           searchTable, tableName, isIndexed(@"old"), sqlDelete]];
+        [db executeUpdate:[NSString stringWithFormat:@"create trigger %@_update after update of %@ on %@ when %@ begin %@ %@ end",
+                           searchTable, columnList, tableName, isIndexed(@"old"), sqlDelete, sqlInsert]];
+    }
+    [self populateSearchIndex];
+}
+
+/* Add the rows that were in the table when the search index was created, a
+ * batch at a time on a background queue so that startup and other database
+ * users are not held up while a large table is indexed.
+ */
++(void)populateSearchIndex
+{
+    if ([self isSearchIndexReady])
+        return;
+    
+    NSString * tableName = [self tableName];
+    NSString * searchTable = [self searchTableName];
+    NSString * identity = [self identityColumn];
+    NSString * columnList = [[self searchColumns] componentsJoinedByString:@", "];
+    NSString * sqlBatch = [NSString stringWithFormat:@"insert into %@(rowid, %@) select %@, %@ from %@ where %@ > ? and %@ <= ?",
+                           searchTable, columnList, identity, columnList, tableName, identity, identity];
+    
+    [LogFile.logFile writeLine:@"Building search index for %@", tableName];
+    dispatch_async(dispatch_get_global_queue(QOS_CLASS_UTILITY, 0), ^{
+        BOOL isDone = NO;
+        
+        while (!isDone)
+        {
+            @synchronized(CIX.DBLock) {
+                FMDatabase * db = CIX.DB;
+                long long indexedID = 0;
+                long long lastID = 0;
+                
+                FMResultSet * results = [db executeQuery:@"select indexedID, lastID from SearchIndexProgress where name=?", searchTable];
+                isDone = ![results next];
+                if (!isDone)
+                {
+                    indexedID = [results longLongIntForColumnIndex:0];
+                    lastID = [results longLongIntForColumnIndex:1];
+                }
+                [results close];
+                
+                if (!isDone)
+                {
+                    long long batchID = MIN(indexedID + SearchIndexBatchSize, lastID);
+                    
+                    [db beginTransaction];
+                    [db executeUpdate:sqlBatch, @(indexedID), @(batchID)];
+                    if (batchID < lastID)
+                        [db executeUpdate:@"update SearchIndexProgress set indexedID=? where name=?", @(batchID), searchTable];
+                    else
+                        [db executeUpdate:@"delete from SearchIndexProgress where name=?", searchTable];
+                    [db commit];
+                }
+            }
+        }
+        [LogFile.logFile writeLine:@"Search index for %@ is complete", tableName];
+    });
+}
+
+/** Return whether the full-text search index holds every row of the table
+ 
+ While a new index is being populated in the background, searches should
+ fall back to matching the table directly.
+ 
+ @return YES if the search index is complete, NO otherwise
+ */
++(BOOL)isSearchIndexReady
+{
+    __block BOOL isReady = YES;
+    [CIX inReadDatabase:^(FMDatabase * db) {
+        isReady = [db intForQuery:@"select count(*) from SearchIndexProgress where name=?", [self searchTableName]] == 0;
+    }];
+    return isReady;
+}
+
 /** Upgrade the table to match the current schema
 
  Currently this just adds missing columns. Later we can add logic to drop
@@ -279,15 +822,19 @@
     }
 }
 
-/* Create the SQL statement to update the record for this class in the database.
+/* Update the record for this class in the database using the cached
+ * parameterised statement. Only the columns that have changed since the
+ * row was loaded or last saved are written, and nothing is written if
+ * none have changed.
  */
 -(void)save
 {
+    TableSchema * schema = [self.class schema];
     id idValue = nil;
     
-    if ([self hasIdentity])
+    if (schema.identityColumn != nil)
     {
-        idValue = [self valueForKey:[self.class identityColumn]] ;
+        idValue = [self valueForKey:schema.identityColumn];
         if ([idValue isKindOfClass:NSNumber.class] && [((NSNumber *)idValue) integerValue] == 0)
         {
             [self saveNew];
@@ -295,79 +842,137 @@
         }
     }
     
-    NSMutableString * sqlCreate = [[NSMutableString alloc] init];
-    
-    [sqlCreate appendString:@"update "];
-    [sqlCreate appendString:[self.class tableName]];
-    [sqlCreate appendString:@" set "];
+    NSArray * currentValues = [self propertyValuesForSchema:schema];
+    NSMutableIndexSet * changedColumns = [NSMutableIndexSet indexSet];
     
-    NSDictionary * properties = [TableBase classPropsFor:self.class];
-    NSString * separator = @"";
+    for (NSUInteger index = 0; index < currentValues.count; ++index)
+        if (_savedValues == nil || ![currentValues[index] isEqual:_savedValues[index]])
+            [changedColumns addIndex:index];
     
-    NSMutableArray * values = [NSMutableArray array];
-    
-    for (NSString * name in properties.allKeys)
-    {
-        NSString * type = [properties valueForKey:name];
-        NSString * value = [self valueForPropertyName:name andType:type];
-
-        if ([name isEqualToString:[self.class identityColumn]])
-            idValue = value;
-        else
-        {
-            [sqlCreate appendFormat:@"%@%@=%@", separator, name, value];
-            [values addObject:value];
-        
-            separator = @",";
-        }
-    }
+    if (changedColumns.count == 0)
+        return;
     
+    NSString * sql = (changedColumns.count == currentValues.count) ? schema.updateSQL : [schema updateSQLForColumns:changedColumns];
+    NSMutableArray * values = [self bindValues:currentValues forColumns:changedColumns schema:schema];
     if (idValue != nil)
-        [sqlCreate appendFormat:@" where %@=%@", [self.class identityColumn], idValue];
+        [values addObject:idValue];
     
     @synchronized(CIX.DBLock) {
-        [CIX.DB executeUpdate:sqlCreate];
+        [CIX.DB executeUpdate:sql withArgumentsInArray:values];
+        [TableBase countWriteOfValues:values];
     }
+    _savedValues = currentValues;
 }
 
-/* Create the SQL statement to insert a new record for this class into the database.
+/* Insert a new record for this class into the database using the cached
+ * parameterised statement.
  */
 -(void)saveNew
 {
-    NSMutableString * sqlCreate = [[NSMutableString alloc] init];
-    NSMutableString * sqlMarkers = [[NSMutableString alloc] init];
+    TableSchema * schema = [self.class schema];
+    NSArray * currentValues = [self propertyValuesForSchema:schema];
+    NSIndexSet * allColumns = [NSIndexSet indexSetWithIndexesInRange:NSMakeRange(0, currentValues.count)];
+    NSMutableArray * values = [self bindValues:currentValues forColumns:allColumns schema:schema];
     
-    [sqlCreate appendString:@"insert into "];
-    [sqlCreate appendString:[self.class tableName]];
-    [sqlCreate appendString:@" ("];
-    
-    NSDictionary * properties = [TableBase classPropsFor:self.class];
-    NSString * separator = @"";
-    
-    BOOL hasIdentity = NO;
+    @synchronized(CIX.DBLock) {
+        [CIX.DB executeUpdate:schema.insertSQL withArgumentsInArray:values];
+        [TableBase countWriteOfValues:values];
+        if (schema.identityColumn != nil)
+            [self setValue:[NSNumber numberWithLongLong:[CIX.DB lastInsertRowId]] forKey:schema.identityColumn];
+    }
+    _savedValues = currentValues;
+}
 
-    for (NSString * name in properties.allKeys)
-    {
-        NSString * type = [properties valueForKey:name];
+/* Record the given values, in schema column order, as matching the
+ * database row.
+ */
+-(void)markSavedWithValues:(NSArray *)values
+{
+    _savedValues = values;
+}
 
-        if ([name isEqualToString:[self.class identityColumn]])
-            hasIdentity = YES;
-        else
+/** Record the specified columns as matching the database row
+ 
+ Call this after the columns have been written to the database outside
+ of save, such as by a set-based UPDATE, so that a later save does not
+ consider them changed.
+ 
+ @param columnNames An array of the property names of the columns written
+ */
+-(void)markColumnsSaved:(NSArray *)columnNames
+{
+    if (_savedValues == nil)
+        return;
+    
+    TableSchema * schema = [self.class schema];
+    NSMutableArray * savedValues = [NSMutableArray arrayWithArray:_savedValues];
+    for (NSString * name in columnNames)
+    {
+        NSUInteger index = [schema.columns indexOfObject:name];
+        if (index != NSNotFound)
         {
-            [sqlCreate appendFormat:@"%@%@", separator, name];
-
-            NSString * value = [self valueForPropertyName:name andType:type];
-            [sqlMarkers appendFormat:@"%@%@", separator, value];
-
-            separator = @",";
+            id value = [self valueForKey:name];
+            savedValues[index] = (value != nil) ? value : [NSNull null];
         }
     }
-    [sqlCreate appendFormat:@") values (%@)", sqlMarkers];
+    _savedValues = savedValues;
+}
 
-    @synchronized(CIX.DBLock) {
-        [CIX.DB executeUpdate:sqlCreate];
-        if (hasIdentity)
-            [self setValue:[NSNumber numberWithLongLong:[CIX.DB lastInsertRowId]] forKey:[self.class identityColumn]];
+/* Return the values of the non-identity columns in schema order, with
+ * NSNull standing in for nil. Strings are copied so that a later change
+ * to a mutable string is still seen as a change.
+ */
+-(NSArray *)propertyValuesForSchema:(TableSchema *)schema
+{
+    NSArray * columns = schema.columns;
+    NSMutableArray * values = [NSMutableArray arrayWithCapacity:columns.count];
+    
+    for (NSString * name in columns)
+    {
+        id value = [self valueForKey:name];
+        if ([value isKindOfClass:NSString.class])
+            value = [value copy];
+        [values addObject:(value != nil) ? value : [NSNull null]];
+    }
+    return values;
+}
+
+/* Return the specified property values as objects that bind directly to
+ * their SQLite types. Images are bound as BLOBs.
+ */
+-(NSMutableArray *)bindValues:(NSArray *)propertyValues forColumns:(NSIndexSet *)columnIndexes schema:(TableSchema *)schema
+{
+    NSArray * types = schema.types;
+    NSMutableArray * values = [NSMutableArray arrayWithCapacity:columnIndexes.count + 1];
+    
+    [columnIndexes enumerateIndexesUsingBlock:^(NSUInteger index, BOOL * stop) {
+        NSString * type = types[index];
+        id value = propertyValues[index];
+        
+        if (value == [NSNull null])
+            value = [type isEqualToString:@"NSString"] ? @"" : value;
+        else if ([type isEqualToString:@"NSImage"])
+            value = [value JFIFData:1.0];
+        
+        [values addObject:(value != nil) ? value : [NSNull null]];
+    }];
+    return values;
+}
+
+/* Add a row and the size of its values to the write counters. Must be
+ * called with the database lock held.
+ */
++(void)countWriteOfValues:(NSArray *)values
+{
+    ++_rowsWritten;
+    for (id value in values)
+    {
+        if ([value isKindOfClass:NSString.class])
+            _bytesWritten += [value lengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+        else if ([value isKindOfClass:NSData.class])
+            _bytesWritten += [value length];
+        else if (value != [NSNull null])
+            _bytesWritten += sizeof(long long);
     }
 }
 
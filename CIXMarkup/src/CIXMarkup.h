@@ -8,4 +8,5 @@
 
 @interface CIXMarkup : NSObject
     +(NSString *)markupToHTML:(NSString *)text;
+    +(NSArray *)markupArrayToHTML:(NSArray *)texts;
 @end
@@ -7,221 +7,390 @@
 //
 
 #import "CIXMarkup.h"
-#import "StringExtensions.h"
 
-@implementation CIXMarkup
+// Character classes for the ASCII range
+enum {
+    MarkupWhitespace = 1,       // Whitespace and newlines
+    MarkupStyle = 2,            // Characters that open or close a style: * / _
+    MarkupCloseDelimiter = 4    // Characters that may follow a closing style
+};
+
+static const unsigned char markupClass[128] = {
+    ['\t'] = MarkupWhitespace, ['\n'] = MarkupWhitespace, ['\v'] = MarkupWhitespace,
+    ['\f'] = MarkupWhitespace, ['\r'] = MarkupWhitespace, [' '] = MarkupWhitespace,
+    ['*'] = MarkupStyle | MarkupCloseDelimiter,
+    ['/'] = MarkupStyle | MarkupCloseDelimiter,
+    ['_'] = MarkupStyle | MarkupCloseDelimiter,
+    ['.'] = MarkupCloseDelimiter,
+    [','] = MarkupCloseDelimiter,
+};
+
+// The HTML tags that are passed through for rendering
+static const char * legalShortTags[] = { "b", "i", "u" };
+static const char * legalLongTags[] = { "font" };
+
+// The characters for which the scanner caches the next position
+enum { ScanBold, ScanUnderline, ScanItalic, ScanTagEnd, ScanCount };
+
+/* The output buffer and the state of the scan over the input buffer.
+ */
+typedef struct {
+    const unichar * input;
+    NSUInteger length;
+    NSUInteger next[ScanCount];
+    unichar * output;
+    NSUInteger outputLength;
+    NSUInteger outputCapacity;
+} MarkupScanner;
+
+/* Return whether the character is whitespace or a newline. Characters
+ * outside the ASCII range are looked up in the Unicode whitespace set.
+ */
+static inline BOOL isWhitespace(unichar ch)
+{
+    static NSCharacterSet * whitespaceSet;
+    static dispatch_once_t onceToken;
+
+    if (ch < 128)
+        return (markupClass[ch] & MarkupWhitespace) != 0;
+    dispatch_once(&onceToken, ^{
+        whitespaceSet = [NSCharacterSet whitespaceAndNewlineCharacterSet];
+    });
+    return [whitespaceSet characterIsMember:ch];
+}
 
-static int _blockQuoteDepth;
+/* Return whether the character belongs to the specified ASCII class
+ * or is whitespace.
+ */
+static inline BOOL isDelimiter(unichar ch, unsigned char class)
+{
+    if (ch < 128 && (markupClass[ch] & class))
+        return YES;
+    return isWhitespace(ch);
+}
 
+/* Make room in the output buffer for the specified number of characters.
+ */
+static inline void reserve(MarkupScanner * scanner, NSUInteger count)
+{
+    if (scanner->outputLength + count > scanner->outputCapacity)
+    {
+        scanner->outputCapacity = MAX(scanner->outputCapacity * 2, scanner->outputLength + count);
+        scanner->output = realloc(scanner->output, scanner->outputCapacity * sizeof(unichar));
+    }
+}
 
-/* Convert the specified text to HTML, translating any markup codes
+/* Append a single character to the output buffer.
+ */
+static inline void appendChar(MarkupScanner * scanner, unichar ch)
+{
+    reserve(scanner, 1);
+    scanner->output[scanner->outputLength++] = ch;
+}
+
+/* Append an ASCII string to the output buffer.
+ */
+static inline void appendString(MarkupScanner * scanner, const char * str)
+{
+    NSUInteger count = strlen(str);
+
+    reserve(scanner, count);
+    for (NSUInteger index = 0; index < count; ++index)
+        scanner->output[scanner->outputLength++] = (unichar)str[index];
+}
+
+/* Return whether the output buffer ends with the specified ASCII string.
+ */
+static BOOL outputEndsWith(MarkupScanner * scanner, const char * str)
+{
+    NSUInteger count = strlen(str);
+
+    if (scanner->outputLength < count)
+        return NO;
+    const unichar * tail = scanner->output + scanner->outputLength - count;
+    for (NSUInteger index = 0; index < count; ++index)
+        if (tail[index] != (unichar)str[index])
+            return NO;
+    return YES;
+}
+
+/* Append a block quote tag. A line break immediately before the tag is
+ * dropped since the block quote already starts a new line.
+ */
+static void appendBlockTag(MarkupScanner * scanner, const char * tag)
+{
+    if (outputEndsWith(scanner, "<br />"))
+        scanner->outputLength -= 6;
+    appendString(scanner, tag);
+}
+
+/* Return the index of the next occurrence of the specified character at or
+ * after index on the current line, or NSNotFound. The position found is
+ * cached so that repeated lookups as the scan advances along the line
+ * never look at the same character twice.
+ */
+static NSUInteger findOnLine(MarkupScanner * scanner, int slot, unichar ch, NSUInteger index)
+{
+    NSUInteger found = scanner->next[slot];
+
+    if (found < index)
+    {
+        found = index;
+        while (found < scanner->length && scanner->input[found] != ch && scanner->input[found] != '\n')
+            ++found;
+        scanner->next[slot] = found;
+    }
+    return (found < scanner->length && scanner->input[found] == ch) ? found : NSNotFound;
+}
+
+/* Return whether the ASCII tag name matches the characters of the tag,
+ * ignoring case.
+ */
+static BOOL tagNameMatches(const unichar * tag, NSUInteger length, const char * name)
+{
+    if (strlen(name) != length)
+        return NO;
+    for (NSUInteger index = 0; index < length; ++index)
+    {
+        unichar ch = tag[index];
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        if (ch != (unichar)name[index])
+            return NO;
+    }
+    return YES;
+}
+
+@implementation CIXMarkup
+
+/* Convert the specified text to HTML, translating any markup codes.
+ * All of the state of the conversion is held in a scanner local to the
+ * call, so this may be called from any number of threads at once.
  */
 +(NSString *)markupToHTML:(NSString *)text
 {
-    NSMutableString * outputString = [[NSMutableString alloc] init];
-    NSArray * lines = [text componentsSeparatedByString:@"\n"];
-    
-    for (NSString * line in lines)
+    MarkupScanner scanner = { 0 };
+
+    scanner.length = text.length;
+
+    unichar * input = malloc(MAX(scanner.length, 1) * sizeof(unichar));
+    [text getCharacters:input range:NSMakeRange(0, scanner.length)];
+    scanner.input = input;
+
+    // Most text passes through unchanged so allow a margin for tags and entities.
+    scanner.outputCapacity = scanner.length + scanner.length / 4 + 64;
+    scanner.output = malloc(scanner.outputCapacity * sizeof(unichar));
+
+    int blockQuoteDepth = 0;
+    NSUInteger index = 0;
+
+    while (index <= scanner.length)
     {
-        if (outputString.length > 0)
-            [outputString appendString:@"<br />"];
-        [outputString appendString:[self parseLine:line]];
+        if (scanner.outputLength > 0)
+            appendString(&scanner, "<br />");
+        index = [self parseLine:&scanner fromIndex:index blockQuoteDepth:&blockQuoteDepth] + 1;
     }
 
-    while (_blockQuoteDepth > 0)
+    while (blockQuoteDepth > 0)
     {
-        [outputString appendString:@"</blockquote>"];
-        --_blockQuoteDepth;
+        appendBlockTag(&scanner, "</blockquote>");
+        --blockQuoteDepth;
     }
-    
-    // Optimise the result
-    [outputString replaceString:@"<br /><blockquote>" withString:@"<blockquote>"];
-    [outputString replaceString:@"<br /></blockquote>" withString:@"</blockquote>"];
-    
-    return outputString;
+    free(input);
+
+    return [[NSString alloc] initWithCharactersNoCopy:scanner.output length:scanner.outputLength freeWhenDone:YES];
 }
 
-/* Return whether the specified character can indicate the start of
- * a style.
+/* Convert an array of texts to HTML, spreading the work across all
+ * available cores. The results are returned in the same order as the
+ * texts.
  */
-+(bool)canPrecedeStyle:(char)ch withChar:(char)newCh
++(NSArray *)markupArrayToHTML:(NSArray *)texts
 {
-    NSMutableCharacterSet * delimiterSet = [NSMutableCharacterSet characterSetWithCharactersInString:@"*/_"];
-    
-    [delimiterSet formUnionWithCharacterSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-    [delimiterSet removeCharactersInRange:NSMakeRange(newCh, 1)];
-    
-    return [delimiterSet characterIsMember:ch];
+    NSUInteger count = texts.count;
+    if (count < 2)
+        return count == 0 ? @[] : @[ [self markupToHTML:texts[0]] ];
+
+    NSString * __strong * results = (NSString * __strong *)calloc(count, sizeof(NSString *));
+    dispatch_apply(count, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t index) {
+        results[index] = [self markupToHTML:texts[index]];
+    });
+
+    NSArray * htmlArray = [NSArray arrayWithObjects:results count:count];
+    for (NSUInteger index = 0; index < count; ++index)
+        results[index] = nil;
+    free(results);
+    return htmlArray;
 }
 
-/* Read the potential HTML tag from line at the given index and return
+/* Read the potential HTML tag starting at the given index and return
  * whether it matches a subset of HTML tags that are passed through for
  * rendering as opposed to being escaped for presentation.
  */
-+(bool)isLegalTag:(NSString *)line withIndex:(int)index
++(BOOL)isLegalTag:(MarkupScanner *)scanner withIndex:(NSUInteger)index
 {
-    NSUInteger endIndex = [line indexOfCharacterInString:'>' afterIndex:index];
-    if (endIndex != NSNotFound && endIndex > index)
+    NSUInteger endIndex = findOnLine(scanner, ScanTagEnd, '>', index);
+    if (endIndex == NSNotFound || endIndex <= index)
+        return NO;
+
+    const unichar * tag = scanner->input + index;
+    NSUInteger length = endIndex - index;
+    if (tag[0] == '/')
     {
-        NSString * tagName = [[line substringWithRange:NSMakeRange(index, endIndex - index)] lowercaseString];
-        if ([tagName hasPrefix:@"/"])
-            tagName = [tagName substringFromIndex:1];
-        
-        NSArray * legalShortTags = @[ @"b", @"i", @"u" ];
-        if ([legalShortTags containsObject:tagName])
-            return YES;
-        
-        // Long tags have attributes separated by spaces so get the tag name as the first word
-        // in the whole tag.
-        endIndex = [tagName indexOfCharacterInString:' ' afterIndex:0];
-        if (endIndex != NSNotFound)
-            tagName = [tagName substringToIndex:endIndex];
-        
-        NSArray * legalLongTags = @[ @"font" ];
-        return [legalLongTags containsObject:tagName];
+        ++tag;
+        --length;
     }
+    for (NSUInteger i = 0; i < sizeof(legalShortTags) / sizeof(legalShortTags[0]); ++i)
+        if (tagNameMatches(tag, length, legalShortTags[i]))
+            return YES;
+
+    // Long tags have attributes separated by spaces so get the tag name as the first word
+    // in the whole tag.
+    for (NSUInteger wordIndex = 0; wordIndex < length; ++wordIndex)
+        if (tag[wordIndex] == ' ')
+        {
+            length = wordIndex;
+            break;
+        }
+    for (NSUInteger i = 0; i < sizeof(legalLongTags) / sizeof(legalLongTags[0]); ++i)
+        if (tagNameMatches(tag, length, legalLongTags[i]))
+            return YES;
     return NO;
 }
 
 /* Look for the close tag for the specified style character. To qualify,
- * the end tag must be followed by whitespace.
+ * the end tag must be followed by whitespace, punctuation or the end of
+ * the line.
  */
-+(bool)hasCloseTag:(NSString *)line withIndex:(int)index tagChar:(char)ch
++(BOOL)hasCloseTag:(MarkupScanner *)scanner withIndex:(NSUInteger)index slot:(int)slot tagChar:(unichar)ch
 {
-    NSUInteger endIndex = [line indexOfCharacterInString:ch afterIndex:index];
-    if (endIndex != NSNotFound && endIndex > index)
-    {
-        if (endIndex + 1 == line.length)
-            return YES;
-
-        char chAfterTag = [line characterAtIndex:endIndex + 1];
-
-        NSMutableCharacterSet * delimiterSet = [NSMutableCharacterSet characterSetWithCharactersInString:@"*/_.,"];
-        [delimiterSet formUnionWithCharacterSet:[NSCharacterSet whitespaceAndNewlineCharacterSet]];
-        
-        return [delimiterSet characterIsMember:chAfterTag];
-    }
-    return NO;
+    NSUInteger endIndex = findOnLine(scanner, slot, ch, index);
+    if (endIndex == NSNotFound || endIndex <= index)
+        return NO;
+    if (endIndex + 1 == scanner->length)
+        return YES;
+    return isDelimiter(scanner->input[endIndex + 1], MarkupCloseDelimiter);
 }
 
-/* Parse the specified line and return its HTML equivalent.
+/* Parse the line starting at the given index into HTML and return the index
+ * of the newline that ends it, or the length of the input for the last line.
  */
-+(NSString *)parseLine:(NSString *)line
++(NSUInteger)parseLine:(MarkupScanner *)scanner fromIndex:(NSUInteger)index blockQuoteDepth:(int *)blockQuoteDepth
 {
-    NSMutableString * outputString = [[NSMutableString alloc] init];
-    bool inBold = NO;
-    bool inUnderline = NO;
-    bool inItalic = NO;
-    bool lineStart = YES;
-    bool absorbTag = NO;
+    const unichar * input = scanner->input;
+    NSUInteger length = scanner->length;
+    BOOL inBold = NO;
+    BOOL inUnderline = NO;
+    BOOL inItalic = NO;
+    BOOL lineStart = YES;
+    BOOL absorbTag = NO;
     int blockCount = 0;
-    char lastChar = '\n';
-    int index = 0;
-    
-    NSCharacterSet * whitespaceSet = [NSCharacterSet whitespaceAndNewlineCharacterSet];
-    while (index < line.length)
+    unichar lastChar = '\n';
+
+    while (index < length && input[index] != '\n')
     {
-        char ch = [line characterAtIndex:index++];
+        unichar ch = input[index++];
         if (absorbTag)
         {
-            [outputString appendFormat:@"%c", ch];
+            appendChar(scanner, ch);
             absorbTag = ch != '>';
             continue;
         }
         if (lineStart)
         {
-            if ([whitespaceSet characterIsMember:ch])
+            if (isWhitespace(ch))
                 continue;
             if (ch == '>')
             {
                 ++blockCount;
                 continue;
             }
-        }
-        if (blockCount > _blockQuoteDepth)
-            while (_blockQuoteDepth != blockCount)
+            while (*blockQuoteDepth < blockCount)
             {
-                [outputString appendString:@"<blockquote>"];
-                ++_blockQuoteDepth;
+                appendBlockTag(scanner, "<blockquote>");
+                ++*blockQuoteDepth;
             }
-        if (blockCount < _blockQuoteDepth)
-            while (_blockQuoteDepth != blockCount)
+            while (*blockQuoteDepth > blockCount)
             {
-                [outputString appendString:@"</blockquote>"];
-                --_blockQuoteDepth;
+                appendBlockTag(scanner, "</blockquote>");
+                --*blockQuoteDepth;
             }
+            lineStart = NO;
+        }
+
+        // A style can open after whitespace or a different style character
+        BOOL canOpenStyle = lastChar != ch && isDelimiter(lastChar, MarkupStyle);
         switch (ch)
         {
             case '<':
-                if ([self isLegalTag:line withIndex:index])
+                if ([self isLegalTag:scanner withIndex:index])
                 {
-                    [outputString appendFormat:@"%c", ch];
+                    appendChar(scanner, ch);
                     absorbTag = YES;
                 }
                 else
-                    [outputString appendString:@"&lt;"];
+                    appendString(scanner, "&lt;");
                 break;
             case '>':
-                [outputString appendString:@"&gt;"];
+                appendString(scanner, "&gt;");
                 break;
             case '&':
-                [outputString appendString:@"&amp;"];
+                appendString(scanner, "&amp;");
                 break;
             case '*':
                 if (inBold)
                 {
-                    [outputString appendString:@"</b>"];
-                    inBold = false;
+                    appendString(scanner, "</b>");
+                    inBold = NO;
                 }
-                else if ([self canPrecedeStyle:lastChar withChar:ch] && [self hasCloseTag:line withIndex:index tagChar:ch])
+                else if (canOpenStyle && [self hasCloseTag:scanner withIndex:index slot:ScanBold tagChar:ch])
                 {
-                    [outputString appendString:@"<b>"];
-                    inBold = true;
+                    appendString(scanner, "<b>");
+                    inBold = YES;
                 }
                 else
-                    [outputString appendFormat:@"%c", ch];
+                    appendChar(scanner, ch);
                 break;
             case '_':
                 if (inUnderline)
                 {
-                    [outputString appendString:@"</u>"];
-                    inUnderline = false;
+                    appendString(scanner, "</u>");
+                    inUnderline = NO;
                 }
-                else if ([self canPrecedeStyle:lastChar withChar:ch] && [self hasCloseTag:line withIndex:index tagChar:ch])
+                else if (canOpenStyle && [self hasCloseTag:scanner withIndex:index slot:ScanUnderline tagChar:ch])
                 {
-                    [outputString appendString:@"<u>"];
-                    inUnderline = true;
+                    appendString(scanner, "<u>");
+                    inUnderline = YES;
                 }
                 else
-                    [outputString appendFormat:@"%c", ch];
+                    appendChar(scanner, ch);
                 break;
             case '/':
                 if (inItalic)
                 {
-                    [outputString appendString:@"</i>"];
-                    inItalic = false;
+                    appendString(scanner, "</i>");
+                    inItalic = NO;
                 }
-                else if ([self canPrecedeStyle:lastChar withChar:ch] && [self hasCloseTag:line withIndex:index tagChar:ch])
+                else if (canOpenStyle && [self hasCloseTag:scanner withIndex:index slot:ScanItalic tagChar:ch])
                 {
-                    [outputString appendString:@"<i>"];
-                    inItalic = true;
+                    appendString(scanner, "<i>");
+                    inItalic = YES;
                 }
                 else
-                    [outputString appendFormat:@"%c", ch];
+                    appendChar(scanner, ch);
                 break;
             default:
-                [outputString appendFormat:@"%c", ch];
+                appendChar(scanner, ch);
                 break;
         }
-        lineStart = false;
         lastChar = ch;
     }
     if (inBold)
-        [outputString appendString:@"</b>"];
+        appendString(scanner, "</b>");
     if (inUnderline)
-        [outputString appendString:@"</u>"];
+        appendString(scanner, "</u>");
     if (inItalic)
-        [outputString appendString:@"</i>"];
-    return outputString;
+        appendString(scanner, "</i>");
+    return index;
 }
 @end
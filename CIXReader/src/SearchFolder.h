@@ -11,5 +11,7 @@
 @interface SearchFolder : SmartFolder
 
 @property (atomic, readwrite) NSString * searchString;
+@property (nonatomic, readonly) NSString * searchText;
+@property (nonatomic, readonly) NSString * searchAuthor;
 
 @end
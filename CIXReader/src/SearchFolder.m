@@ -8,6 +8,7 @@
 
 #import "SearchFolder.h"
 #import "StringExtensions.h"
+#import "CIX.h"
 
 static NSImage * searchFolderImage;
 
@@ -29,12 +30,35 @@ static NSImage * searchFolderImage;
     return NSLocalizedString(@"Search Results", nil);
 }
 
-/* Return a SQL criteria string for this folder based on the current
- * search string.
+/* Return the search string with any all: prefix removed.
  */
--(NSString *)criteria
+-(NSString *)searchText
 {
-    return [NSString stringWithFormat:@"Body like '%%%@%%'", [self.searchString safeQuotes]];
+    NSString * searchString = self.searchString.trim;
+    if ([searchString hasPrefix:@"from:"])
+        return nil;
+    if ([searchString hasPrefix:@"all:"])
+        return [searchString substringFromIndex:4].trim;
+    return searchString;
+}
+
+/* Return the author named by a from: search string, or nil.
+ */
+-(NSString *)searchAuthor
+{
+    NSString * searchString = self.searchString.trim;
+    if ([searchString hasPrefix:@"from:"])
+        return [searchString substringFromIndex:5].trim;
+    return nil;
+}
+
+/* Return the messages matching the current search string, best
+ * match first, from the full-text index.
+ */
+-(NSArray *)items
+{
+    NSArray * results = [CIX.folderCollection searchMessages:self.searchText fromAuthor:self.searchAuthor];
+    return [results valueForKey:@"message"];
 }
 
 /* Return the folder display name.
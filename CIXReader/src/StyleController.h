@@ -12,6 +12,14 @@
     NSString * _jsScript;
     NSString * _styleName;
     BOOL _inited;
+    NSMutableDictionary * _renderedMarkup;
+    NSString * _highlightPattern;
+    NSRegularExpression * _highlightRegex;
+    NSArray * _templateSegments;
+    NSMutableDictionary * _renderCache;
+    NSMutableOrderedSet * _renderCacheOrder;
+    NSUInteger _renderCacheSize;
+    NSMutableArray * _prerenderItems;
 }
 
 // Properties
@@ -22,6 +30,7 @@
 +(void)loadStylesMap;
 -(NSString *)styledTextForCollection:(NSArray *)array;
 -(NSArray *)allStyles;
+-(void)prerenderCollection:(NSArray *)array;
 
 -(NSString *)imageFromTag:(NSString *)tag;
 -(NSString *)htmlFromTag:(NSString *)tag;
@@ -17,7 +17,108 @@
 
 // Styles path mappings is global across all instances
 static NSMutableDictionary * _stylePathMappings = nil;
-static NSDictionary * _mapEmoticonToName = nil;
+
+// Link rewriting expressions and emoticon image tags are global across all instances
+static NSRegularExpression * _linkRegex = nil;
+static NSRegularExpression * _mailtoRegex = nil;
+static NSRegularExpression * _cixLinkRegex = nil;
+static NSRegularExpression * _cixFileRegex = nil;
+static NSRegularExpression * _attachRegex = nil;
+static NSRegularExpression * _inlineImageRegex = nil;
+static NSRegularExpression * _dropboxRegex = nil;
+static NSRegularExpression * _emoticonRegex = nil;
+static NSDictionary * _emoticonTags = nil;
+
+// Upper limit on the characters of rendered HTML kept in the render cache
+static const NSUInteger MaxRenderCacheSize = 2 * 1024 * 1024;
+
+/* One section of a parsed style template. The section alternates literal
+ * text with tags, starting and ending with literal text, and is stripped
+ * from the output if it is conditional and all its tags expand to blanks.
+ */
+@interface StyleTemplateSegment : NSObject {
+    NSArray * _literals;
+    SEL * _tags;
+    NSUInteger _tagCount;
+    BOOL _conditional;
+}
+-(id)initWithString:(NSString *)theString conditional:(BOOL)cond;
+-(NSString *)expandWithItem:(id)item styleController:(StyleController *)styleController;
+@end
+
+@implementation StyleTemplateSegment
+
+/* Split the template text into literals and the selectors of the $tag$
+ * placeholders between them.
+ */
+-(id)initWithString:(NSString *)theString conditional:(BOOL)cond
+{
+    if ((self = [super init]) != nil)
+    {
+        NSMutableArray * literals = [NSMutableArray array];
+        NSMutableArray * tagNames = [NSMutableArray array];
+        NSUInteger literalStartIndex = 0;
+        NSUInteger tagStartIndex;
+        
+        while ((tagStartIndex = [theString indexOfCharacterInString:'$' afterIndex:literalStartIndex]) != NSNotFound)
+        {
+            NSUInteger tagEndIndex = [theString indexOfCharacterInString:'$' afterIndex:tagStartIndex + 1];
+            if (tagEndIndex == NSNotFound)
+                break;
+            
+            [literals addObject:[theString substringWithRange:NSMakeRange(literalStartIndex, tagStartIndex - literalStartIndex)]];
+            [tagNames addObject:[theString substringWithRange:NSMakeRange(tagStartIndex + 1, tagEndIndex - tagStartIndex - 1)]];
+            literalStartIndex = tagEndIndex + 1;
+        }
+        [literals addObject:[theString substringFromIndex:literalStartIndex]];
+        
+        _literals = literals;
+        _tagCount = tagNames.count;
+        _tags = calloc(MAX(_tagCount, 1), sizeof(SEL));
+        for (NSUInteger index = 0; index < _tagCount; ++index)
+            _tags[index] = NSSelectorFromString([NSString stringWithFormat:@"tag%@:", tagNames[index]]);
+        _conditional = cond;
+    }
+    return self;
+}
+
+/* Expand the tags in this segment based on the item values. A tag for which
+ * the item has no function is just deleted from the output.
+ */
+-(NSString *)expandWithItem:(id)item styleController:(StyleController *)styleController
+{
+    NSMutableString * newString = [NSMutableString stringWithString:_literals[0]];
+    BOOL hasOneTag = NO;
+    BOOL cond = _conditional;
+    
+    for (NSUInteger index = 0; index < _tagCount; ++index)
+    {
+        SEL selector = _tags[index];
+        if ([item respondsToSelector:selector])
+        {
+            IMP imp = [item methodForSelector:selector];
+            NSString * (*func)(id, SEL, StyleController *) = (void *)imp;
+            NSString * replacementString = func(item, selector, styleController);
+            
+            if (replacementString != nil)
+            {
+                [newString appendString:replacementString];
+                hasOneTag = YES;
+                
+                if (![replacementString isBlank])
+                    cond = NO;
+            }
+        }
+        [newString appendString:_literals[index + 1]];
+    }
+    return (cond && hasOneTag) ? @"" : newString;
+}
+
+-(void)dealloc
+{
+    free(_tags);
+}
+@end
 
 @implementation StyleController
 
@@ -30,6 +131,7 @@ static NSDictionary * _mapEmoticonToName = nil;
     if ((self = [super init]) != nil)
     {
         _styleName = styleName;
+        _renderedMarkup = [NSMutableDictionary dictionary];
         _inited = NO;
     }
     return self;
@@ -102,10 +204,150 @@ static NSDictionary * _mapEmoticonToName = nil;
                 }
             }
         }
+        [self parseTemplate];
+        _renderCache = [NSMutableDictionary dictionary];
+        _renderCacheOrder = [NSMutableOrderedSet orderedSet];
+        _renderCacheSize = 0;
         _inited = YES;
     }
 }
 
+/* Parse the template into the list of segments that are expanded for each
+ * item. Sections in <!-- cond:noblank--> and <!--end--> are stripped out if
+ * all the tags inside are blank. Other comments are dropped.
+ */
+-(void)parseTemplate
+{
+    if (_htmlTemplate == nil)
+    {
+        _templateSegments = nil;
+        return;
+    }
+    
+    NSMutableArray * segments = [NSMutableArray array];
+    NSScanner * scanner = [NSScanner scannerWithString:_htmlTemplate];
+    NSString * theString = nil;
+    BOOL stripIfEmpty = NO;
+    
+    while(![scanner isAtEnd])
+    {
+        if ([scanner scanUpToString:@"<!--" intoString:&theString])
+            [segments addObject:[[StyleTemplateSegment alloc] initWithString:theString conditional:stripIfEmpty]];
+        
+        if ([scanner scanString:@"<!--" intoString:nil])
+        {
+            NSString * commentTag = nil;
+            
+            if ([scanner scanUpToString:@"-->" intoString:&commentTag] && commentTag != nil)
+            {
+                commentTag = [commentTag trim];
+                if ([commentTag isEqualToString:@"cond:noblank"])
+                    stripIfEmpty = YES;
+                if ([commentTag isEqualToString:@"end"])
+                    stripIfEmpty = NO;
+                [scanner scanString:@"-->" intoString:nil];
+            }
+        }
+    }
+    _templateSegments = segments;
+}
+
+/* Return a 64-bit FNV-1a hash of the whole of a string. Unlike -[NSString hash],
+ * which only samples a long string, every character changes the result.
+ */
+static unsigned long long TextHash(NSString * text)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (const char * bytes = SafeString(text).UTF8String; *bytes != '\0'; ++bytes)
+    {
+        hash ^= (uint8_t)*bytes;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Return the key that identifies the rendering of a message, or nil if the
+ * item is not one whose rendering is cached. The key covers everything other
+ * than the message ID that the rendered HTML depends on, so a message that
+ * changes in a way that alters its rendering simply misses the cache. Since
+ * the date is shown relative to today, today's date is part of the key too.
+ */
+-(NSString *)renderKeyForItem:(id)item
+{
+    if (![item isKindOfClass:Message.class])
+        return nil;
+    
+    Message * message = (Message *)item;
+    Preferences * prefs = [Preferences standardPreferences];
+    NSUInteger today = [[NSCalendar currentCalendar] ordinalityOfUnit:NSCalendarUnitDay inUnit:NSCalendarUnitEra forDate:NSDate.date];
+    return [NSString stringWithFormat:@"%d:%d:%d:%lld:%@:%016llx:%.0f:%lu:%@:%@:%d:%d",
+            message.remoteID,
+            message.isPseudo,
+            message.commentID,
+            message.topicID,
+            SafeString(message.author),
+            TextHash(message.bodyWithAttachments),
+            message.date.timeIntervalSinceReferenceDate,
+            (unsigned long)today,
+            _styleName,
+            SafeString(self.highlightString),
+            prefs.ignoreMarkup,
+            prefs.downloadInlineImages];
+}
+
+/* Return the cached rendering of the item if the cache holds one that is
+ * still current.
+ */
+-(NSString *)cachedHTMLForItem:(id)item withKey:(NSString *)key
+{
+    NSNumber * itemID = @([(Message *)item ID]);
+    NSArray * entry = _renderCache[itemID];
+    if (entry == nil || ![entry[0] isEqualToString:key])
+        return nil;
+    
+    [_renderCacheOrder removeObject:itemID];
+    [_renderCacheOrder addObject:itemID];
+    return entry[1];
+}
+
+/* Add the rendering of the item to the cache, dropping the least recently
+ * used renderings to keep the cache within its size limit.
+ */
+-(void)cacheHTML:(NSString *)html forItem:(id)item withKey:(NSString *)key
+{
+    [self removeCachedItem:item];
+    
+    NSNumber * itemID = @([(Message *)item ID]);
+    _renderCache[itemID] = @[ key, html ];
+    [_renderCacheOrder addObject:itemID];
+    _renderCacheSize += html.length;
+    
+    while (_renderCacheSize > MaxRenderCacheSize && _renderCacheOrder.count > 1)
+    {
+        NSNumber * oldestID = _renderCacheOrder.firstObject;
+        _renderCacheSize -= [_renderCache[oldestID][1] length];
+        [_renderCache removeObjectForKey:oldestID];
+        [_renderCacheOrder removeObjectAtIndex:0];
+    }
+}
+
+/* Remove the cached rendering of an item.
+ */
+-(void)removeCachedItem:(id)item
+{
+    if (![item isKindOfClass:Message.class])
+        return;
+    
+    NSNumber * itemID = @([(Message *)item ID]);
+    NSArray * entry = _renderCache[itemID];
+    if (entry != nil)
+    {
+        _renderCacheSize -= [entry[1] length];
+        [_renderCache removeObjectForKey:itemID];
+        [_renderCacheOrder removeObject:itemID];
+    }
+}
+
 /** Decode a tag that resolves into a mugshot URL.
  
  @param tag The tag argument
@@ -126,121 +368,320 @@ static NSDictionary * _mapEmoticonToName = nil;
     return [[tag GMTBSTtoUTC] friendlyDescription];
 }
 
--(NSString *)htmlFromTag:(NSString *)tag
+/* Compile the regular expressions used to rewrite links in message bodies,
+ * and build the image tags for the emoticons. These are the same for every
+ * style so they are only built once.
+ */
++(void)compileRewriters
+{
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        NSRegularExpressionOptions options = NSRegularExpressionCaseInsensitive;
+        
+        _linkRegex = [NSRegularExpression regularExpressionWithPattern:@"(((http|https|ftp|news|file)+://|www\\.|ftp\\.)[&#95;.a-z0-9-]+[a-z0-9/&#95;:@=.+?,#!$_%&()~-]*[^.|\'|# |!|\(|?|,| |>|<|;|)])" options:options error:nil];
+        _mailtoRegex = [NSRegularExpression regularExpressionWithPattern:@"(mailto:\\b[A-Z0-9._%+-]+@[A-Z0-9.-]+\\.[A-Z]{2,}\\b)" options:options error:nil];
+        _cixLinkRegex = [NSRegularExpression regularExpressionWithPattern:@"(cix\\:[a-z0-9._\\-:/]*[a-z0-9]+)" options:options error:nil];
+        _cixFileRegex = [NSRegularExpression regularExpressionWithPattern:@"cixfile\\:([a-z0-9._\\-]+)/([a-z0-9._\\-]+):([a-z0-9\\/&#95;:@=.+?,#_%&~-]+)" options:options error:nil];
+        _attachRegex = [NSRegularExpression regularExpressionWithPattern:@"(attach:[0-9]+/[0-9]+/[0-9]+)" options:options error:nil];
+        _inlineImageRegex = [NSRegularExpression regularExpressionWithPattern:@"(<a href=\"(http|https):.*?.(?:jpe?g|gif|png).*?\">)(.*?)(</a>)" options:options error:nil];
+        _dropboxRegex = [NSRegularExpression regularExpressionWithPattern:@"(src=\")(https:\\/\\/www\\.dropbox\\.com.*?)(\\?dl=0)*(\")" options:options error:nil];
+        
+        NSDictionary * mapEmoticonToName = @{@":-)" : @"smiley",
+                                             @":-D" : @"laugh",
+                                             @":-(" : @"frown",
+                                             @";-)" : @"wink",
+                                             @"8-)" : @"shades"};
+        
+        NSMutableDictionary * emoticonTags = [NSMutableDictionary dictionary];
+        NSMutableArray * emoticonPatterns = [NSMutableArray array];
+        for (NSString * key in mapEmoticonToName)
+        {
+            NSString * filePath = [[NSBundle mainBundle] pathForResource:mapEmoticonToName[key] ofType:@"tiff"];
+            NSURL * fileURL = [NSURL fileURLWithPath:filePath];
+            
+            emoticonTags[key] = [NSString stringWithFormat:@"<img src=\"%@\" />", fileURL.absoluteString];
+            [emoticonPatterns addObject:[NSRegularExpression escapedPatternForString:key]];
+        }
+        _emoticonTags = emoticonTags;
+        _emoticonRegex = [NSRegularExpression regularExpressionWithPattern:[emoticonPatterns componentsJoinedByString:@"|"] options:0 error:nil];
+    });
+}
+
+/* Return the regular expression that matches the current highlight string,
+ * compiling it only when the highlight string changes.
+ */
+-(NSRegularExpression *)highlightRegex
+{
+    NSString * highlightString = self.highlightString;
+    if (IsEmpty(highlightString))
+        return nil;
+    
+    if (_highlightRegex == nil || ![_highlightPattern isEqualToString:highlightString])
+    {
+        NSString * linkPattern = [NSString stringWithFormat:@"(%@)", [NSRegularExpression escapedPatternForString:highlightString]];
+        _highlightRegex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:nil];
+        _highlightPattern = highlightString;
+    }
+    return _highlightRegex;
+}
+
+/* Return the tag text with any occurrences of the highlight string marked
+ * up, ready for the markup to be rendered.
+ */
+-(NSMutableString *)highlightedStringFromTag:(NSString *)tag
 {
     Preferences * prefs = [Preferences standardPreferences];
     NSMutableString * modifiedString = [NSMutableString stringWithString:(prefs.ignoreMarkup) ? [tag quoteAttributes] : tag];
     
-    NSError * error = NULL;
-    
-    if (!IsEmpty(self.highlightString))
-    {
-        NSString * linkPattern = [NSString stringWithFormat:@"(%@)", self.highlightString];
-        NSRegularExpression * regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
+    NSRegularExpression * regex = [self highlightRegex];
+    if (regex != nil)
         [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<font style=\"BACKGROUND-COLOR: yellow\">$1</font>"];
-    }
+    return modifiedString;
+}
+
+/* Return the given string with every match of the regular expression replaced
+ * by the result of the block, built into a single new string.
+ */
+-(NSMutableString *)rewriteString:(NSString *)source withRegex:(NSRegularExpression *)regex usingBlock:(NSString * (^)(NSString * match))block
+{
+    NSMutableString * output = [NSMutableString stringWithCapacity:source.length];
+    __block NSUInteger lastIndex = 0;
     
-    // Render markup if permitted
+    [regex enumerateMatchesInString:source options:0 range:NSMakeRange(0, source.length) usingBlock:^(NSTextCheckingResult * result, NSMatchingFlags flags, BOOL * stop) {
+        [output appendString:[source substringWithRange:NSMakeRange(lastIndex, result.range.location - lastIndex)]];
+        [output appendString:block([source substringWithRange:result.range])];
+        lastIndex = NSMaxRange(result.range);
+    }];
+    [output appendString:[source substringFromIndex:lastIndex]];
+    return output;
+}
+
+-(NSString *)htmlFromTag:(NSString *)tag
+{
+    Preferences * prefs = [Preferences standardPreferences];
+    NSMutableString * modifiedString = [self highlightedStringFromTag:tag];
+    
+    [StyleController compileRewriters];
+    
+    // Render markup if permitted, using the markup already rendered for
+    // the collection if there is any.
     if (prefs.ignoreMarkup)
         [modifiedString replaceString:@"\n" withString:@"<br />"];
     else
     {
-        NSString * markedString = [CIXMarkup markupToHTML:modifiedString];
+        NSString * markedString = [self takeRenderedMarkup:modifiedString];
+        if (markedString == nil)
+            markedString = [CIXMarkup markupToHTML:modifiedString];
         modifiedString = [markedString mutableCopy];
     }
     
     // Convert HTTP:// (etc) and www / ftp (etc) links to actual links.
-    NSString * linkPattern = @"(((http|https|ftp|news|file)+://|www\\.|ftp\\.)[&#95;.a-z0-9-]+[a-z0-9/&#95;:@=.+?,#!$_%&()~-]*[^.|\'|# |!|\(|?|,| |>|<|;|)])";
-    NSRegularExpression * regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-    [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"$1\">$1</a>"];
+    [_linkRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"$1\">$1</a>"];
     [modifiedString replaceString:@"href=\"www" withString:@"href=\"http://www"];
     
     // Catch mailto links
-    linkPattern = @"(mailto:\\b[A-Z0-9._%+-]+@[A-Z0-9.-]+\\.[A-Z]{2,}\\b)";
-    regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-    [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"$1\">$1</a>"];
+    [_mailtoRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"$1\">$1</a>"];
     
     // Make cix: style links clickable
-    linkPattern = @"(cix\\:[a-z0-9._\\-:/]*[a-z0-9]+)";
-    regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-    
-    NSRange textRange = NSMakeRange(0, modifiedString.length);
-    NSTextCheckingResult * result = [regex firstMatchInString:modifiedString options:0 range:textRange];
-    while (result != nil && result.range.location != NSNotFound)
-    {
-        NSString * match = [modifiedString substringWithRange:result.range];
+    modifiedString = [self rewriteString:modifiedString withRegex:_cixLinkRegex usingBlock:^NSString *(NSString * match) {
         Message * message = [(AppDelegate *)[NSApp delegate] messageFromAddress:match];
         NSString * popupText = @"";
-
+        
         if (message != nil)
             popupText = [NSString stringWithFormat:@"<span class=\"tooltip_text\">%@</span>", [[[message body] quoteAttributes] truncateByWordWithLimit:200]];
         
         // Remove any cix/cixfile within the popuptext to prevent them being styled
         popupText = [popupText stringByReplacingOccurrencesOfString:@"cixfile:" withString:@""];
         popupText = [popupText stringByReplacingOccurrencesOfString:@"cix:" withString:@""];
-
-        NSString * fmt = [NSString stringWithFormat:@"<a onmouseover=\"tooltipShow(event,this)\" onmouseout=\"tooltipHide(event,this)\" href=\"%@\">%@%@</a>", match, match, popupText];
-
-        [modifiedString deleteCharactersInRange:result.range];
-        [modifiedString insertString:fmt atIndex:result.range.location];
-
-        textRange.location = result.range.location + fmt.length;
-        textRange.length = modifiedString.length - textRange.location;
         
-        result = [regex firstMatchInString:modifiedString options:0 range:textRange];
-    }
+        return [NSString stringWithFormat:@"<a onmouseover=\"tooltipShow(event,this)\" onmouseout=\"tooltipHide(event,this)\" href=\"%@\">%@%@</a>", match, match, popupText];
+    }];
     
     // Make cixfile: links into URL links.
-    linkPattern = @"cixfile\\:([a-z0-9._\\-]+)/([a-z0-9._\\-]+):([a-z0-9\\/&#95;:@=.+?,#_%&~-]+)";
-    regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-    [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"http://forums.cix.co.uk/secure/cixfile.aspx?forum=$1&topic=$2&file=$3\">cixfile:$1/$2:$3</a>"];
+    [_cixFileRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<a href=\"http://forums.cix.co.uk/secure/cixfile.aspx?forum=$1&topic=$2&file=$3\">cixfile:$1/$2:$3</a>"];
     
     // Make attach: elements into img tags
-    linkPattern = @"(attach:[0-9]+/[0-9]+/[0-9]+)";
-    regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-    [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<img src=\"$1\" />"];
+    [_attachRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"<img src=\"$1\" />"];
     
     // Make http links to image files into img links so we can have inline images
     if (prefs.downloadInlineImages)
     {
-        NSString * linkPattern = @"(<a href=\"(http|https):.*?.(?:jpe?g|gif|png).*?\">)(.*?)(</a>)";
-        NSRegularExpression * regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-        [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"$1<img width=30% border=\"0\" src=\"$3\" />$4"];
+        [_inlineImageRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"$1<img width=30% border=\"0\" src=\"$3\" />$4"];
         
         // Look for src="https://www.dropbox.com" and append the raw marker to it.
-        linkPattern = @"(src=\")(https:\\/\\/www\\.dropbox\\.com.*?)(\\?dl=0)*(\")";
-        regex = [NSRegularExpression regularExpressionWithPattern:linkPattern options:NSRegularExpressionCaseInsensitive error:&error];
-        [regex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"$1$2?raw=1$4"];
+        [_dropboxRegex replaceMatchesInString:modifiedString options:0 range:NSMakeRange(0, [modifiedString length]) withTemplate:@"$1$2?raw=1$4"];
     }
     
     // Replace emoticons with their graphical equivalent.
     if (!prefs.ignoreMarkup)
-        [self replaceEmoticons:modifiedString];
+        modifiedString = [self rewriteString:modifiedString withRegex:_emoticonRegex usingBlock:^NSString *(NSString * match) {
+            return _emoticonTags[match];
+        }];
     
     return [NSString stringWithFormat:@"<p>%@</p>", modifiedString];
 }
 
-/* Convert any emoticons in the string to references to their
- * actual file in the bundle.
+/* Return the highlighted text of each item in the collection from which
+ * its markup is rendered.
  */
--(void)replaceEmoticons:(NSMutableString *)source
+-(NSArray *)markupSourcesForCollection:(NSArray *)array
 {
-    if (_mapEmoticonToName == nil)
-        _mapEmoticonToName = @{@":-)" : @"smiley",
-                               @":-D" : @"laugh",
-                               @":-(" : @"frown",
-                               @";-)" : @"wink",
-                               @"8-)" : @"shades"};
-    
-    for (NSString * key in _mapEmoticonToName.allKeys)
+    SEL selector = NSSelectorFromString(@"markupText");
+    NSMutableArray * sources = [NSMutableArray arrayWithCapacity:array.count];
+    for (id item in array)
     {
-        NSString * emoticon = _mapEmoticonToName[key];
+        if (![item respondsToSelector:selector])
+            continue;
         
-        NSString * filePath = [[NSBundle mainBundle] pathForResource:emoticon ofType:@"tiff"];
-        NSURL * fileURL = [NSURL fileURLWithPath:filePath];
+        IMP imp = [item methodForSelector:selector];
+        NSString * (*func)(id, SEL) = (void *)imp;
+        [sources addObject:[self highlightedStringFromTag:func(item, selector)]];
+    }
+    return sources;
+}
+
+/* Save rendered markup for htmlFromTag: to pick up. This may be called
+ * from any thread.
+ */
+-(void)storeRenderedMarkup:(NSArray *)htmlArray forSources:(NSArray *)sources
+{
+    @synchronized(_renderedMarkup) {
+        [_renderedMarkup addEntriesFromDictionary:[NSDictionary dictionaryWithObjects:htmlArray forKeys:sources]];
+    }
+}
+
+/* Return and remove the rendered markup saved for the given text, if any.
+ */
+-(NSString *)takeRenderedMarkup:(NSString *)source
+{
+    @synchronized(_renderedMarkup) {
+        NSString * html = _renderedMarkup[source];
+        if (html != nil)
+            [_renderedMarkup removeObjectForKey:source];
+        return html;
+    }
+}
+
+/* Render the markup of the body of every item in the collection that is
+ * not in the render cache at once, in parallel, so that expanding the
+ * template for each item only has to look up the result. Returns the
+ * texts whose markup was rendered.
+ */
+-(NSArray *)renderMarkupForCollection:(NSArray *)array
+{
+    if (array.count < 2 || [Preferences standardPreferences].ignoreMarkup)
+        return @[];
+    
+    NSMutableArray * uncachedItems = [NSMutableArray arrayWithCapacity:array.count];
+    for (id item in array)
+    {
+        NSString * renderKey = [self renderKeyForItem:item];
+        if (renderKey == nil || [self cachedHTMLForItem:item withKey:renderKey] == nil)
+            [uncachedItems addObject:item];
+    }
+    if (uncachedItems.count < 2)
+        return @[];
+    
+    NSArray * sources = [self markupSourcesForCollection:uncachedItems];
+    [self storeRenderedMarkup:[CIXMarkup markupArrayToHTML:sources] forSources:sources];
+    return sources;
+}
+
+/* Drop rendered markup that was not used.
+ */
+-(void)discardRenderedMarkup:(NSArray *)sources
+{
+    if (sources.count == 0)
+        return;
+    
+    @synchronized(_renderedMarkup) {
+        [_renderedMarkup removeObjectsForKeys:sources];
+    }
+}
+
+/* Return the HTML for one item expanded through the style template, from
+ * the render cache if it holds a current rendering.
+ */
+-(NSString *)templateHTMLForItem:(id)item
+{
+    NSString * renderKey = [self renderKeyForItem:item];
+    NSString * htmlMessage = (renderKey != nil) ? [self cachedHTMLForItem:item withKey:renderKey] : nil;
+    if (htmlMessage == nil)
+    {
+        NSMutableString * expandedMessage = [[NSMutableString alloc] init];
+        for (StyleTemplateSegment * segment in _templateSegments)
+            [expandedMessage appendString:[segment expandWithItem:item styleController:self]];
+        htmlMessage = expandedMessage;
         
-        [source replaceString:key withString:[NSString stringWithFormat:@"<img src=\"%@\" />", fileURL.absoluteString]];
+        if (renderKey != nil)
+            [self cacheHTML:htmlMessage forItem:item withKey:renderKey];
+    }
+    return htmlMessage;
+}
+
+/** Render items into the render cache ahead of them being displayed
+ 
+ The markup of the items is rendered on a background queue. The templates are
+ then expanded on the main thread, one item at a time while the run loop has no
+ input to handle, which also resolves any cix: references in the items, so that
+ a later call to styledTextForCollection: for any of these items is served from
+ the cache.
+ 
+ @param array The items likely to be displayed next
+ */
+-(void)prerenderCollection:(NSArray *)array
+{
+    [self loadStyle];
+    if (_htmlTemplate == nil)
+        return;
+    
+    NSMutableArray * pending = [NSMutableArray array];
+    for (id item in array)
+    {
+        NSString * renderKey = [self renderKeyForItem:item];
+        if (renderKey != nil && [self cachedHTMLForItem:item withKey:renderKey] == nil)
+            [pending addObject:item];
+    }
+    if (pending.count == 0)
+        return;
+    
+    // Anything left over from an earlier batch was never displayed
+    @synchronized(_renderedMarkup) {
+        [_renderedMarkup removeAllObjects];
     }
+    
+    NSArray * sources = [Preferences standardPreferences].ignoreMarkup ? @[] : [self markupSourcesForCollection:pending];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_LOW, 0), ^{
+        [self storeRenderedMarkup:[CIXMarkup markupArrayToHTML:sources] forSources:sources];
+        dispatch_async(dispatch_get_main_queue(), ^{
+            self->_prerenderItems = [pending mutableCopy];
+            [self schedulePrerenderTemplates];
+        });
+    });
+}
+
+/* Arrange for the next prerendered item to have its template expanded once
+ * the main run loop is idle. Any expansion already scheduled is replaced.
+ */
+-(void)schedulePrerenderTemplates
+{
+    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(prerenderNextTemplate) object:nil];
+    if (_prerenderItems.count > 0)
+        [self performSelector:@selector(prerenderNextTemplate) withObject:nil afterDelay:0 inModes:@[ NSDefaultRunLoopMode ]];
+}
+
+/* Expand the template for one prerendered item, then wait for the run loop
+ * to be idle again before doing the next so that input is not held up.
+ */
+-(void)prerenderNextTemplate
+{
+    if (_prerenderItems.count == 0)
+        return;
+    
+    id item = _prerenderItems[0];
+    [_prerenderItems removeObjectAtIndex:0];
+    [self templateHTMLForItem:item];
+    [self schedulePrerenderTemplates];
 }
 
 /** Return an NSString containing the tagged item collection formatted as HTML
@@ -274,52 +715,24 @@ static NSDictionary * _mapEmoticonToName = nil;
     [htmlText appendFormat:@"<script type=\"text/javascript\" src=\"%@/popup.js\"/></script>", libpath];
     [htmlText appendString:@"<meta http-equiv=\"Pragma\" content=\"no-cache\">"];
     [htmlText appendString:@"</head><body>"];
+    NSArray * renderedSources = (_htmlTemplate != nil) ? [self renderMarkupForCollection:array] : nil;
     for (index = 0; index < array.count; ++index)
     {
         id item = array[index];
         
         // Load the selected HTML template for the current view style and plug in the current
         // article values and style sheet setting.
-        NSMutableString * htmlMessage;
+        NSString * htmlMessage;
         if (_htmlTemplate == nil)
         {
             SEL selector = NSSelectorFromString(@"unformattedText");
             IMP imp = [item methodForSelector:selector];
             NSString * (*func)(id, SEL) = (void *)imp;
             
-            NSMutableString * articleBody = [NSMutableString stringWithString:func(item, selector)];
-            htmlMessage = [[NSMutableString alloc] initWithString:articleBody];
+            htmlMessage = func(item, selector);
         }
         else
-        {
-            htmlMessage = [[NSMutableString alloc] initWithString:@""];
-            NSScanner * scanner = [NSScanner scannerWithString:_htmlTemplate];
-            NSString * theString = nil;
-            BOOL stripIfEmpty = NO;
-            
-            // Handle conditional tag expansion. Sections in <!-- cond:noblank--> and <!--end-->
-            // are stripped out if all the tags inside are blank.
-            while(![scanner isAtEnd])
-            {
-                if ([scanner scanUpToString:@"<!--" intoString:&theString])
-                    [htmlMessage appendString:[self expandTags:theString withItem:item withConditional:stripIfEmpty]];
-                
-                if ([scanner scanString:@"<!--" intoString:nil])
-                {
-                    NSString * commentTag = nil;
-                    
-                    if ([scanner scanUpToString:@"-->" intoString:&commentTag] && commentTag != nil)
-                    {
-                        commentTag = [commentTag trim];
-                        if ([commentTag isEqualToString:@"cond:noblank"])
-                            stripIfEmpty = YES;
-                        if ([commentTag isEqualToString:@"end"])
-                            stripIfEmpty = NO;
-                        [scanner scanString:@"-->" intoString:nil];
-                    }
-                }
-            }
-        }
+            htmlMessage = [self templateHTMLForItem:item];
         
         // Separate each message with a horizontal divider line
         if (index > 0)
@@ -327,49 +740,9 @@ static NSDictionary * _mapEmoticonToName = nil;
         [htmlText appendString:htmlMessage];
     }
     [htmlText appendString:@"</body></html>"];
-    return htmlText;
-}
-
-/* Expands recognised tags in theString based on the object values.
- */
--(NSString *)expandTags:(NSString *)theString withItem:(id)item withConditional:(BOOL)cond
-{
-    NSMutableString * newString = [NSMutableString stringWithString:theString];
-    BOOL hasOneTag = NO;
-    NSUInteger tagStartIndex = 0;
     
-    while ((tagStartIndex = [newString indexOfCharacterInString:'$' afterIndex:tagStartIndex]) != NSNotFound)
-    {
-        NSUInteger tagEndIndex = [newString indexOfCharacterInString:'$' afterIndex:tagStartIndex + 1];
-        if (tagEndIndex == NSNotFound)
-            break;
-        
-        NSUInteger tagLength = (tagEndIndex - tagStartIndex) + 1;
-        NSString * tagName = [newString substringWithRange:NSMakeRange(tagStartIndex + 1, tagLength - 2)];
-        NSString * replacementString = nil;
-        
-        // Use the tag name as the selector to a member function that returns the expanded
-        // value. If no function exists then we just delete the tag name from the source string.
-        NSString * tagSelName = [NSString stringWithFormat:@"tag%@:", tagName];
-        
-        SEL selector = NSSelectorFromString(tagSelName);
-        IMP imp = [item methodForSelector:selector];
-        NSString * (*func)(id, SEL, StyleController *) = (void *)imp;
-        replacementString = func(item, selector, self);
-        
-        if (replacementString == nil)
-            [newString deleteCharactersInRange:NSMakeRange(tagStartIndex, tagLength)];
-        else
-        {
-            [newString replaceCharactersInRange:NSMakeRange(tagStartIndex, tagLength) withString:replacementString];
-            hasOneTag = YES;
-            
-            if (![replacementString isBlank])
-                cond = NO;
-            
-            tagStartIndex += [replacementString length];
-        }
-    }
-    return (cond && hasOneTag) ? @"" : newString;
+    // Any markup left over belongs to items whose body is repeated in the collection
+    [self discardRenderedMarkup:renderedSources];
+    return htmlText;
 }
 @end
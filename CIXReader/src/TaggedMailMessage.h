@@ -9,4 +9,5 @@
 #import "MailMessage.h"
 
 @interface MailMessage (TaggedMailMessage)
+-(NSString *)markupText;
 @end
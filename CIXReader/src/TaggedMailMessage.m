@@ -42,12 +42,19 @@
     return @"";
 }
 
+/* Return the text from which the message body is rendered.
+ */
+-(NSString *)markupText
+{
+    return self.body;
+}
+
 /* Returns the message body.
  * We first format it to render correctly in an HTML block.
  */
 -(NSString *)tagBody:(StyleController *)styleController
 {
-    return [styleController htmlFromTag:self.body];
+    return [styleController htmlFromTag:self.markupText];
 }
 
 /* Returns the message author as a safe string.
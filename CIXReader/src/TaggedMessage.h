@@ -9,4 +9,5 @@
 #import "Message.h"
 
 @interface Message (TaggedMessage)
+-(NSString *)markupText;
 @end
@@ -43,12 +43,19 @@
     return self.commentID > 0 ? [NSString stringWithFormat:@"%i", self.commentID] : @"";
 }
 
+/* Return the text from which the message body is rendered.
+ */
+-(NSString *)markupText
+{
+    return self.bodyWithAttachments;
+}
+
 /* Returns the message body.
  * We first format it to render correctly in an HTML block.
  */
 -(NSString *)tagBody:(StyleController *)styleController
 {
-    return [styleController htmlFromTag:self.bodyWithAttachments];
+    return [styleController htmlFromTag:self.markupText];
 }
 
 /* Returns the message author as a safe string.
@@ -24,6 +24,12 @@ static NSImage * readlockedImage = nil;
 static NSImage * threadClosedImage = nil;
 static NSImage * threadOpenImage = nil;
 
+// Number of unread messages after the selection to render ahead
+static const NSUInteger PrerenderUnreadCount = 3;
+
+// Number of rows after the selection searched for unread messages to render
+static const NSInteger PrerenderScanLimit = 200;
+
 @implementation TopicView
 
 /* Initialise the topic view.
@@ -127,6 +133,9 @@ static NSImage * threadOpenImage = nil;
         {
             _currentFolder = folder;
             _isFiltering = NO;
+
+            // Let the refresh scheduler favour the topic being viewed
+            CIX.folderCollection.visibleFolder = [folder isKindOfClass:TopicFolder.class] ? ((TopicFolder *)folder).folder : nil;
             _currentStyleController.highlightString = nil;
             
             [threadList deselectAll:self];
@@ -1280,7 +1289,26 @@ static NSImage * threadOpenImage = nil;
         
         [messageText clearOverlayView];
         [messageText setHTML:[_currentStyleController styledTextForCollection:@[ message ]]];
+        [self prerenderUnreadAfterRow:threadList.selectedRow];
+    }
+}
+
+/* Render the next few unread messages after the given row in the
+ * background so that moving to them with next unread is instant. Only the
+ * rows near the selection are searched, so that selecting a message in a
+ * large topic that is mostly read does not walk the rest of it.
+ */
+-(void)prerenderUnreadAfterRow:(NSInteger)row
+{
+    NSMutableArray * unreadMessages = [NSMutableArray array];
+    NSInteger lastRow = MIN(row + PrerenderScanLimit, (NSInteger)_messages.count - 1);
+    while (++row <= lastRow && unreadMessages.count < PrerenderUnreadCount)
+    {
+        Message * message = _messages[row];
+        if (message.unread)
+            [unreadMessages addObject:message];
     }
+    [_currentStyleController prerenderCollection:unreadMessages];
 }
 
 /* Return the current view and selected item as an address.